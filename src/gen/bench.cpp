@@ -0,0 +1,95 @@
+#include "voxmap.h"
+#include "snapshot.h"
+#include "stages.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+// Times the volume stages of bin/voxmap on each storage layout.
+//
+//   bin/bench [--in maps/map.vxs] [--repeat 3]
+//
+// The volume comes from a snapshot saved by a linear build of bin/voxmap
+// (make maps/map.vxs) and is copied into every layout, so each run sees
+// the same data. Every layout must produce the same sums, distances and
+// faces; the checksums printed next to the timings say whether they did.
+
+using stages::O;
+
+int repeat;
+
+// best of --repeat runs, in ms
+double time(auto function) {
+  double best = 1e30;
+  for (int i = 0; i < repeat; i++) {
+    auto begin = std::chrono::steady_clock::now();
+    function();
+    std::chrono::duration<double, std::milli> ms =
+        std::chrono::steady_clock::now() - begin;
+    best = std::min(best, ms.count());
+  }
+  return best;
+}
+
+template <typename L>
+void run(std::string name, const Grid<uint8_t> &col0, const Grid<uint8_t> &bin0,
+         int pal_size) {
+  Grid<uint8_t, 1, L> col(X, Y, Z);
+  Grid<uint8_t, 1, L> bin(X, Y, Z);
+  Grid<int, 1, L> sum(X, Y, Z);
+  Grid<std::array<uint8_t, O>, 0, L> sdf(X, Y, Z);
+  col.assign(col0);
+  col.clamp_border();
+  bin.assign(bin0);
+
+  long quads = 0;
+  uint64_t check_sum = 0, check_sdf = 0;
+
+  double t_sum = time([&] { stages::summed(bin, sum); });
+  double t_sdf = time([&] { stages::distance(bin, stages::empty(sum), sdf); });
+  double t_faces = time([&] {
+    quads = 0;
+    stages::faces(col, pal_size, [&](auto...) { quads++; });
+  });
+
+  for (int x = 0; x < X; x++)
+  for (int y = 0; y < Y; y++)
+  for (int z = 0; z < Z; z++) {
+    check_sum = check_sum * 31 + sum(x, y, z);
+    check_sdf = check_sdf * 31 + sdf(x, y, z)[0] * 256 + sdf(x, y, z)[1];
+  }
+
+  printf("%-10s %12.1f %12.1f %12.1f %10zu MB   %016lx %016lx %ld\n",
+         name.c_str(), t_sum, t_sdf, t_faces,
+         (col.bytes() + bin.bytes() + sum.bytes() + sdf.bytes()) >> 20,
+         (unsigned long)check_sum, (unsigned long)check_sdf, quads);
+}
+
+int main(int argc, char **argv) {
+  Args args(argc, argv);
+  std::string path = args.get("--in", "maps/map.vxs");
+  repeat = std::max(1, args.get("--repeat", 3));
+
+  snapshot::mapping mapped(path);
+  const snapshot::header &h = *mapped.h;
+  if (h.dims[0] != X || h.dims[1] != Y || h.dims[2] != Z)
+    throw std::runtime_error(path + " has different map dimensions");
+  if (h.layout != Linear::id)
+    throw std::runtime_error(path + " was not saved by a linear build");
+
+  Grid<uint8_t> col(X, Y, Z), bin(X, Y, Z);
+  col.bind(mapped.get(snapshot::COL, col.bytes()));
+  bin.bind(mapped.get(snapshot::BIN, bin.bytes()));
+
+  printf("%-10s %12s %12s %12s %13s   %-16s %-16s %s\n", "layout", "SAT ms",
+         "SDF ms", "faces ms", "memory", "sum check", "sdf check", "quads");
+  run<Linear>("linear", col, bin, h.pal_size);
+  run<Brick<4>>("brick 4", col, bin, h.pal_size);
+  run<Brick<8>>("brick 8", col, bin, h.pal_size);
+  run<Brick<16>>("brick 16", col, bin, h.pal_size);
+
+  return 0;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "voxmap.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+// Blue noise by void and cluster (Ulichney 1993), and the spectrum
+// numbers bin/noise reports for its channels.
+//
+// Each pixel of an s*s torus gets a rank in [0, s^2). Pixels are ranked
+// one at a time, each time the one farthest from those ranked so far:
+// "far" is the lowest energy, a Gaussian (sigma 1.5) summed over the
+// ranked pixels, wrapping around the edges so the tile repeats. Ranks
+// spread evenly at every threshold, so the noise has almost no low
+// frequencies and averages out over a few frames of jitter.
+//
+// The Gaussian is cut off RADIUS pixels out, so ranking a pixel changes
+// (2 RADIUS + 1)^2 energies; the lowest energy is kept in a tournament
+// tree, O(log s) per change. A 1024^2 tile takes some 15 s on one core
+// instead of the textbook's hours; a 128^2 one, 0.15 s.
+
+namespace blue {
+
+const double SIGMA = 1.5;
+const int RADIUS = 5;
+
+// the leaf with the least key, ties to the lower index
+class tournament {
+  int n;
+  std::vector<double> key;
+  std::vector<int> best; // per node, the winning leaf below it
+
+  int winner(int a, int b) const {
+    return key[b] < key[a] || (key[b] == key[a] && b < a) ? b : a;
+  }
+
+public:
+  explicit tournament(int size) : n(std::bit_ceil((unsigned)size)) {
+    key.assign(n, std::numeric_limits<double>::infinity());
+    best.resize(2 * n);
+    for (int i = 0; i < n; i++) best[n + i] = i;
+    for (int p = n - 1; p > 0; p--) best[p] = winner(best[2 * p], best[2 * p + 1]);
+  }
+
+  void set(int i, double k) {
+    key[i] = k;
+    for (int p = (i + n) / 2; p > 0; p /= 2) {
+      int was = best[p];
+      best[p] = winner(best[2 * p], best[2 * p + 1]);
+      // nothing above changes if i neither won nor wins here
+      if (best[p] == was && was != i) break;
+    }
+  }
+
+  int top() const { return best[1]; }
+};
+
+// rank of each pixel (x * s + y) of an s*s tile; random(k) picks the
+// initial pattern
+inline std::vector<uint32_t> void_and_cluster(int s, auto random) {
+  if (s < 2 * RADIUS + 1)
+    throw std::runtime_error("blue: tiles are at least " +
+                             std::to_string(2 * RADIUS + 1) + " wide");
+  const int n = s * s;
+  const double INF = std::numeric_limits<double>::infinity();
+
+  double weight[2 * RADIUS + 1][2 * RADIUS + 1];
+  for (int dx = -RADIUS; dx <= RADIUS; dx++)
+  for (int dy = -RADIUS; dy <= RADIUS; dy++)
+    weight[dx + RADIUS][dy + RADIUS] =
+        std::exp(-(dx * dx + dy * dy) / (2 * SIGMA * SIGMA));
+
+  struct state {
+    std::vector<uint8_t> on;
+    std::vector<double> energy;
+    tournament voids, clusters; // least energy off, most energy on
+  };
+  state now = {std::vector<uint8_t>(n), std::vector<double>(n),
+               tournament(n), tournament(n)};
+  for (int i = 0; i < n; i++) now.voids.set(i, 0);
+
+  auto toggle = [&](int i) {
+    now.on[i] ^= 1;
+    double sign = now.on[i] ? 1 : -1;
+    int x = i / s, y = i % s;
+    for (int dx = -RADIUS; dx <= RADIUS; dx++) {
+      int row = (x + dx + s) % s * s;
+      for (int dy = -RADIUS; dy <= RADIUS; dy++) {
+        int j = row + (y + dy + s) % s;
+        now.energy[j] += sign * weight[dx + RADIUS][dy + RADIUS];
+        now.voids.set(j, now.on[j] ? INF : now.energy[j]);
+        now.clusters.set(j, now.on[j] ? -now.energy[j] : INF);
+      }
+    }
+  };
+
+  // a random tenth, then swap the tightest cluster into the largest void
+  // until that moves nothing
+  int ones = std::max(1, n / 10);
+  for (uint64_t k = 0, count = 0; count < (uint64_t)ones; k++) {
+    int i = random(k) % n;
+    if (!now.on[i]) toggle(i), count++;
+  }
+  for (int moves = 0; moves < n; moves++) {
+    int cluster = now.clusters.top();
+    toggle(cluster);
+    int gap = now.voids.top();
+    toggle(gap);
+    if (gap == cluster) break;
+  }
+  state initial = now;
+
+  // ranks below the pattern's: take away its tightest clusters
+  std::vector<uint32_t> rank(n);
+  for (int r = ones - 1; r >= 0; r--) {
+    int cluster = now.clusters.top();
+    toggle(cluster);
+    rank[cluster] = r;
+  }
+
+  // and above: fill the largest voids, up to every pixel (past half
+  // this is the same as taking the tightest clusters of the off pixels)
+  now = std::move(initial);
+  for (int r = ones; r < n; r++) {
+    int gap = now.voids.top();
+    toggle(gap);
+    rank[gap] = r;
+  }
+  return rank;
+}
+
+// in-place radix-2 FFT of the n values at data[0], data[stride], ...
+inline void fft(std::complex<double> *data, int n, size_t stride) {
+  for (int i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) std::swap(data[i * stride], data[j * stride]);
+  }
+  for (int len = 2; len <= n; len <<= 1) {
+    std::complex<double> w = std::polar(1.0, -2 * M_PI / len);
+    for (int i = 0; i < n; i += len) {
+      std::complex<double> wk = 1;
+      for (int k = 0; k < len / 2; k++, wk *= w) {
+        std::complex<double> &a = data[(i + k) * stride];
+        std::complex<double> &b = data[(i + k + len / 2) * stride];
+        std::complex<double> t = b * wk;
+        b = a - t;
+        a += t;
+      }
+    }
+  }
+}
+
+// How blue a channel is, from its radially averaged power spectrum:
+// low is the mean power below a quarter of the Nyquist frequency over
+// the mean power of all frequencies up to it (1 for white noise, near 0
+// for blue); peak is where the spectrum is highest, in fractions of
+// Nyquist.
+struct spectrum {
+  double low, peak;
+};
+
+// value(x, y) of an n*n texture, n a power of two
+inline spectrum measure(int n, auto value) {
+  std::vector<std::complex<double>> f((size_t)n * n);
+  double mean = 0;
+  for (int x = 0; x < n; x++)
+  for (int y = 0; y < n; y++) mean += value(x, y);
+  mean /= (double)n * n;
+  parFor(0, n, [&](int x) {
+    for (int y = 0; y < n; y++) f[(size_t)x * n + y] = value(x, y) - mean;
+    fft(&f[(size_t)x * n], n, 1);
+  });
+  parFor(0, n, [&](int y) { fft(&f[y], n, n); });
+
+  std::vector<double> power(n / 2 + 1);
+  std::vector<long> count(n / 2 + 1);
+  for (int x = 0; x < n; x++)
+  for (int y = 0; y < n; y++) {
+    int fx = x <= n / 2 ? x : x - n, fy = y <= n / 2 ? y : y - n;
+    int r = (int)std::lround(std::sqrt((double)fx * fx + fy * fy));
+    if (r == 0 || r > n / 2) continue;
+    power[r] += std::norm(f[(size_t)x * n + y]);
+    count[r]++;
+  }
+
+  double low = 0, all = 0;
+  long low_count = 0, all_count = 0;
+  int peak = 1;
+  for (int r = 1; r <= n / 2; r++) {
+    if (r < n / 8) low += power[r], low_count += count[r];
+    all += power[r], all_count += count[r];
+    if (power[r] / count[r] > power[peak] / count[peak]) peak = r;
+  }
+  return {(low / low_count) / (all / all_count), peak / (n / 2.0)};
+}
+
+} // namespace blue
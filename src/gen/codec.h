@@ -0,0 +1,154 @@
+#pragma once
+
+#include "gzstream.h"
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#ifdef VOXMAP_ZSTD
+#include <zstd.h>
+#endif
+
+// Whole-buffer compression for generator outputs.
+// gzip is what the web client reads (through pako); brotli and zstd
+// (build with -DVOXMAP_ZSTD -lzstd) are there to size up other hosting.
+// The codec picks the file extension: .gz, .br or .zst.
+
+namespace codec {
+
+inline std::string extension(std::string codec) {
+  if (codec == "gzip") return ".gz";
+  if (codec == "brotli") return ".br";
+  if (codec == "zstd") return ".zst";
+  throw std::runtime_error("codec: unknown codec " + codec);
+}
+
+// level < 0 means the codec's default
+inline void write(std::string path, const char *data, size_t length,
+                  std::string codec, int level = -1, bool parallel = true) {
+  path += extension(codec);
+
+  if (codec == "gzip") {
+    gz::ofstream out(path, level < 0 ? Z_DEFAULT_COMPRESSION : level,
+                     parallel);
+    out.write(data, length);
+    out.close();
+    return;
+  }
+
+  std::vector<char> out;
+  if (codec == "brotli") {
+    size_t size = BrotliEncoderMaxCompressedSize(length);
+    out.resize(size);
+    if (!BrotliEncoderCompress(level < 0 ? BROTLI_DEFAULT_QUALITY : level,
+                               BROTLI_MAX_WINDOW_BITS, BROTLI_MODE_GENERIC,
+                               length, (const uint8_t *)data,
+                               &size, (uint8_t *)out.data()))
+      throw std::runtime_error("codec: brotli failed");
+    out.resize(size);
+  } else {
+#ifdef VOXMAP_ZSTD
+    out.resize(ZSTD_compressBound(length));
+    size_t size = ZSTD_compress(out.data(), out.size(), data, length,
+                                level < 0 ? 19 : level);
+    if (ZSTD_isError(size)) throw std::runtime_error("codec: zstd failed");
+    out.resize(size);
+#else
+    throw std::runtime_error("codec: built without zstd");
+#endif
+  }
+
+  std::ofstream file(path, std::ios::binary);
+  file.exceptions(std::fstream::badbit);
+  file.write(out.data(), out.size());
+}
+inline void write(std::string path, const std::vector<char> &data,
+                  std::string codec, int level = -1, bool parallel = true) {
+  write(path, data.data(), data.size(), codec, level, parallel);
+}
+
+// compress the file at path to path + the codec's extension; gzip reads
+// it a piece at a time, the others need all of it at once
+inline void compress(std::string path, std::string codec, int level = -1,
+                     bool parallel = true) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) throw std::runtime_error("codec: cannot open " + path);
+  in.exceptions(std::fstream::badbit);
+  if (codec != "gzip") {
+    std::vector<char> data(std::istreambuf_iterator<char>(in), {});
+    write(path, data, codec, level, parallel);
+    return;
+  }
+  gz::ofstream out(path + extension(codec),
+                   level < 0 ? Z_DEFAULT_COMPRESSION : level, parallel);
+  std::vector<char> piece(1 << 20);
+  while (in.read(piece.data(), piece.size()) || in.gcount())
+    out.write(piece.data(), in.gcount());
+  out.close();
+}
+
+// read a file written by write(), codec taken from the extension
+inline std::vector<char> read(std::string path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) throw std::runtime_error("codec: cannot open " + path);
+  std::vector<char> in(std::istreambuf_iterator<char>(file), {});
+  std::vector<char> out;
+
+  auto ends = [&](std::string ext) {
+    return path.size() >= ext.size() &&
+           path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+  };
+
+  if (ends(".gz")) {
+    z_stream s = {};
+    inflateInit2(&s, 16 + MAX_WBITS);
+    s.next_in = (Bytef *)in.data();
+    s.avail_in = in.size();
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+      out.resize(out.size() + (1 << 20));
+      s.next_out = (Bytef *)out.data() + s.total_out;
+      s.avail_out = out.size() - s.total_out;
+      ret = inflate(&s, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END)
+        throw std::runtime_error("codec: bad gzip data in " + path);
+    }
+    out.resize(s.total_out);
+    inflateEnd(&s);
+  } else if (ends(".br")) {
+    auto *s = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+    size_t avail_in = in.size();
+    auto *next_in = (const uint8_t *)in.data();
+    auto ret = BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT;
+    size_t total = 0;
+    while (ret == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
+      out.resize(out.size() + (1 << 20));
+      size_t avail_out = out.size() - total;
+      auto *next_out = (uint8_t *)out.data() + total;
+      ret = BrotliDecoderDecompressStream(s, &avail_in, &next_in, &avail_out,
+                                          &next_out, &total);
+    }
+    BrotliDecoderDestroyInstance(s);
+    if (ret != BROTLI_DECODER_RESULT_SUCCESS)
+      throw std::runtime_error("codec: bad brotli data in " + path);
+    out.resize(total);
+  } else if (ends(".zst")) {
+#ifdef VOXMAP_ZSTD
+    out.resize(ZSTD_getFrameContentSize(in.data(), in.size()));
+    size_t size = ZSTD_decompress(out.data(), out.size(), in.data(), in.size());
+    if (ZSTD_isError(size))
+      throw std::runtime_error("codec: bad zstd data in " + path);
+#else
+    throw std::runtime_error("codec: built without zstd");
+#endif
+  } else {
+    out = std::move(in);
+  }
+
+  return out;
+}
+
+} // namespace codec
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <tbb/parallel_for.h>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// Preconditioning for map.bin before compression.
+//
+// map.bin is X*Y*Z RGBA texels (x fastest): sdf down, sdf up, color, 0.
+// Interleaved like that, deflate sees little repetition. Planed, it is
+//
+//   "VXP1" X Y Z axis      (uint32 little-endian each)
+//   sdf down plane          delta-coded along axis (0 = x, 1 = y, 2 = z)
+//   sdf up plane            delta-coded along axis
+//   color plane             as is
+//
+// and the alpha plane, always 0, is dropped. SDFs change by at most 1
+// between neighbors, so the delta planes are mostly 0, 1 and 255.
+// The first slice along the axis is stored as is.
+
+namespace filter {
+
+const char MAGIC[4] = {'V', 'X', 'P', '1'};
+const int HEADER = 20;
+const int PLANES = 3;
+
+inline void put32(char *p, uint32_t x) {
+  for (int i = 0; i < 4; i++) p[i] = (char)(x >> (8 * i));
+}
+inline uint32_t get32(const char *p) {
+  uint32_t x = 0;
+  for (int i = 0; i < 4; i++) x |= (uint32_t)(uint8_t)p[i] << (8 * i);
+  return x;
+}
+
+// distance between neighbors along axis, and the axis' length
+inline size_t stride(int axis, int X, int Y) {
+  return axis == 0 ? 1 : axis == 1 ? X : (size_t)X * Y;
+}
+inline size_t length(int axis, int X, int Y, int Z) {
+  return axis == 0 ? X : axis == 1 ? Y : Z;
+}
+
+inline std::vector<char> encode(const char *rgba, size_t size, int X, int Y,
+                                int Z, int axis) {
+  size_t n = (size_t)X * Y * Z;
+  if (size != 4 * n) throw std::runtime_error("filter: bad map size");
+  if (axis < 0 || axis > 2) throw std::runtime_error("filter: bad axis");
+
+  std::vector<char> out(HEADER + PLANES * n);
+  memcpy(out.data(), MAGIC, 4);
+  put32(&out[4], X);
+  put32(&out[8], Y);
+  put32(&out[12], Z);
+  put32(&out[16], axis);
+
+  size_t s = stride(axis, X, Y);
+  size_t period = s * length(axis, X, Y, Z);
+
+  char *plane = out.data() + HEADER;
+  tbb::parallel_for(0, Y * Z, [&](int row) {
+    for (size_t i = (size_t)row * X; i < (size_t)(row + 1) * X; i++) {
+      bool first = i % period < s;
+      for (int c = 0; c < 2; c++) {
+        uint8_t v = rgba[4 * i + c];
+        uint8_t prev = first ? 0 : rgba[4 * (i - s) + c];
+        plane[c * n + i] = (char)(uint8_t)(v - prev);
+      }
+      plane[2 * n + i] = rgba[4 * i + 2];
+    }
+  });
+
+  return out;
+}
+
+inline std::vector<char> decode(const std::vector<char> &planes, int &X,
+                                int &Y, int &Z) {
+  if (planes.size() < HEADER || memcmp(planes.data(), MAGIC, 4))
+    throw std::runtime_error("filter: not a planed map");
+  X = get32(&planes[4]);
+  Y = get32(&planes[8]);
+  Z = get32(&planes[12]);
+  int axis = get32(&planes[16]);
+
+  size_t n = (size_t)X * Y * Z;
+  if (planes.size() != HEADER + PLANES * n)
+    throw std::runtime_error("filter: truncated planes");
+
+  size_t s = stride(axis, X, Y);
+  size_t period = s * length(axis, X, Y, Z);
+
+  // i - s < i, so one pass in memory order sees every prefix it needs
+  std::vector<char> rgba(4 * n);
+  const char *plane = planes.data() + HEADER;
+  for (size_t i = 0; i < n; i++) {
+    bool first = i % period < s;
+    for (int c = 0; c < 2; c++) {
+      uint8_t prev = first ? 0 : rgba[4 * (i - s) + c];
+      rgba[4 * i + c] = (char)(uint8_t)(prev + plane[c * n + i]);
+    }
+    rgba[4 * i + 2] = plane[2 * n + i];
+  }
+
+  return rgba;
+}
+
+} // namespace filter
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <tbb/task_group.h>
+#include <zlib.h>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// gzip output stream, pigz-style:
+// bytes are cut into fixed-size blocks, each block is deflated on its own
+// (primed with the previous 32 KiB as dictionary) and the results are
+// stitched into a single gzip member, so any gunzip or pako can read it.
+// Blocks are compressed on the TBB pool as soon as they fill up, and
+// written out in order as soon as they are done. At most MAX_PENDING
+// blocks are in flight, so a fast writer can't queue a whole file.
+
+namespace gz {
+
+const int BLOCK = 128 * 1024;
+const int WINDOW = 32 * 1024;
+const size_t MAX_PENDING = 64;
+
+class streambuf : public std::streambuf {
+  struct block {
+    std::vector<char> in, out, dict;
+    uLong crc = 0, len = 0;
+    bool last = false;
+    std::atomic<bool> done = false;
+  };
+
+  std::ofstream file, raw;
+  std::deque<std::unique_ptr<block>> pending;
+  std::unique_ptr<block> current;
+  std::vector<char> window; // tail of the previous block
+  tbb::task_group tasks;
+  int level = Z_DEFAULT_COMPRESSION;
+  bool parallel = true;
+  uLong crc = crc32(0, Z_NULL, 0);
+  uLong size = 0;
+
+  static void deflate_block(block &b, int level) {
+    z_stream s = {};
+    if (deflateInit2(&s, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::runtime_error("gz: deflateInit2 failed");
+    if (!b.dict.empty())
+      deflateSetDictionary(&s, (Bytef *)b.dict.data(), b.dict.size());
+
+    b.out.resize(deflateBound(&s, b.in.size()) + 16);
+    s.next_in = (Bytef *)b.in.data();
+    s.avail_in = b.in.size();
+    s.next_out = (Bytef *)b.out.data();
+    s.avail_out = b.out.size();
+
+    // non-final blocks end byte-aligned on an empty stored block
+    int ret = deflate(&s, b.last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret != (b.last ? Z_STREAM_END : Z_OK))
+      throw std::runtime_error("gz: deflate failed");
+
+    b.out.resize(b.out.size() - s.avail_out);
+    b.crc = crc32(0, (Bytef *)b.in.data(), b.in.size());
+    deflateEnd(&s);
+
+    b.in = {};
+    b.dict = {};
+    b.done = true;
+  }
+
+  void put32(uLong x) {
+    for (int i = 0; i < 4; i++) file.put((char)(x >> (8 * i) & 0xFF));
+  }
+
+  // write finished blocks in order; wait for all of them if asked to
+  void drain(bool all) {
+    if (all) tasks.wait();
+    while (!pending.empty() && pending.front()->done) {
+      block &b = *pending.front();
+      file.write(b.out.data(), b.out.size());
+      crc = crc32_combine(crc, b.crc, b.len);
+      size += b.len;
+      pending.pop_front();
+    }
+  }
+
+  void submit(bool last) {
+    block *b = current.release();
+    b->in.resize(pptr() - pbase());
+    b->len = b->in.size();
+    b->last = last;
+    b->dict = window;
+
+    if (raw.is_open()) raw.write(b->in.data(), b->in.size());
+
+    size_t n = std::min<size_t>(WINDOW, b->in.size());
+    window.assign(b->in.end() - n, b->in.end());
+
+    pending.emplace_back(b);
+    if (parallel) tasks.run([b, level = level] { deflate_block(*b, level); });
+    else deflate_block(*b, level);
+
+    drain(pending.size() >= MAX_PENDING);
+    if (last) setp(nullptr, nullptr);
+    else fresh();
+  }
+
+  void fresh() {
+    current = std::make_unique<block>();
+    current->in.resize(BLOCK);
+    setp(current->in.data(), current->in.data() + BLOCK);
+  }
+
+protected:
+  int_type overflow(int_type c) override {
+    submit(false);
+    if (c != traits_type::eof()) sputc(c);
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    for (std::streamsize left = n; left > 0;) {
+      std::streamsize k = std::min<std::streamsize>(left, epptr() - pptr());
+      std::copy(s, s + k, pptr());
+      pbump(k);
+      s += k;
+      left -= k;
+      if (pptr() == epptr()) submit(false);
+    }
+    return n;
+  }
+
+public:
+  // like std::filebuf, a destructor that closes swallows its errors;
+  // call close() to see them
+  ~streambuf() noexcept {
+    try {
+      close();
+    } catch (...) {
+    }
+  }
+
+  bool is_open() const { return file.is_open(); }
+
+  // raw: also write the uncompressed bytes to path without its ".gz"
+  void open(std::string path, int level, bool parallel, bool raw) {
+    this->level = level;
+    this->parallel = parallel;
+    file.exceptions(std::fstream::badbit);
+    file.open(path, std::ios::binary);
+    if (!file.is_open()) throw std::runtime_error("gz: cannot open " + path);
+    if (raw) {
+      std::string raw_path = path.substr(0, path.rfind(".gz"));
+      this->raw.exceptions(std::fstream::badbit);
+      this->raw.open(raw_path, std::ios::binary);
+      if (!this->raw.is_open()) {
+        file.close();
+        throw std::runtime_error("gz: cannot open " + raw_path);
+      }
+    }
+    // gzip header: magic, deflate, no flags, no mtime, unix
+    const char header[10] = {0x1f, (char)0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    file.write(header, sizeof header);
+    fresh();
+  }
+
+  void close() {
+    if (!is_open()) return;
+    submit(true);
+    drain(true);
+    put32(crc);
+    put32(size);
+    file.close();
+    if (raw.is_open()) raw.close();
+  }
+};
+
+class ofstream : public std::ostream {
+  gz::streambuf buf;
+
+public:
+  ofstream() : std::ostream(&buf) {}
+  ofstream(std::string path, int level = Z_DEFAULT_COMPRESSION,
+           bool parallel = true, bool raw = false)
+      : std::ostream(&buf) {
+    open(path, level, parallel, raw);
+  }
+
+  void open(std::string path, int level = Z_DEFAULT_COMPRESSION,
+            bool parallel = true, bool raw = false) {
+    buf.open(path, level, parallel, raw);
+  }
+  void close() { buf.close(); }
+};
+
+} // namespace gz
@@ -0,0 +1,80 @@
+#include "voxmap.h"
+#include "raster.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The survey's polygons, maps/map.csv: one "x,y" point per line, each
+// polygon's points after a "-depth,..." line (so x is never negative).
+// Depth d is painted as gray 8 d; the first polygon of the file ends up
+// on top. Points before the first depth line belong to no polygon and
+// are dropped.
+std::vector<raster::polygon> read_csv(std::string path)
+{
+	std::ifstream in(path);
+	if(!in) throw std::runtime_error("cannot open " + path);
+
+	std::vector<raster::polygon> polygons;
+	std::string line;
+	for(int number = 1; std::getline(in, line); number++) {
+		if(line.find_first_not_of(" \t\r") == std::string::npos) continue;
+		auto bad = [&]() {
+			return std::runtime_error(path + ":" + std::to_string(number) +
+					": expected x,y or -depth, not \"" + line + "\"");
+		};
+		size_t comma = line.find(',');
+		if(comma == std::string::npos) throw bad();
+
+		if(line[0] == '-') {
+			int depth;
+			std::istringstream field(line.substr(1, comma - 1));
+			if(!(field >> depth) || !(field >> std::ws).eof()) throw bad();
+			if(depth < 0 || depth * 8 > 255)
+				throw std::runtime_error(path + ":" + std::to_string(number) +
+						": depth " + std::to_string(depth) + " is past 31");
+			polygons.push_back({{}, (uint8_t)(depth * 8)});
+			continue;
+		}
+
+		double x, y;
+		if(!(std::istringstream(line.substr(0, comma)) >> x) ||
+				!(std::istringstream(line.substr(comma + 1)) >> y)) throw bad();
+		if(!polygons.empty()) polygons.back().points.push_back({x, y});
+	}
+
+	// painted last to first
+	std::reverse(polygons.begin(), polygons.end());
+	return polygons;
+}
+
+// The starting point of maps/map.ora, which is then cleaned up by hand
+// in Krita: the depth layer, flipped, and its outline as layer1, made by
+// thresholding at 0 and edge detection, all in memory and in parallel.
+// Depth is filled from the survey's polygons on a black --width x
+// --height raster (1024 x 512), or read from a PGM with --depth.
+//
+//   bin/layers --csv maps/map.csv --save maps/old.map.ora
+int main(int argc, char **argv)
+{
+	Args args(argc, argv);
+	std::string path = args.get("--save", "maps/old.map.ora");
+
+	raster::image depth;
+	if(args.has("--depth")) {
+		depth = pnm::read_pgm(args.get("--depth", ""));
+	} else {
+		auto polygons = read_csv(args.get("--csv", "maps/map.csv"));
+		depth = raster::image(args.get("--width", 1024), args.get("--height", 512));
+		raster::fill(depth, polygons);
+		std::cout << polygons.size() << " polygons" << std::endl;
+	}
+	raster::flip(depth);
+	raster::image edges = raster::edge(raster::threshold(depth, 0));
+
+	raster::write_ora(path, {{"layer1", &edges}, {"layer0", &depth}});
+	std::cout << depth.width() << " x " << depth.height() << ", saved " << path << std::endl;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <utility>
+
+// Storage for the big volumes.
+//
+// Volumes are mapped straight from the kernel, 2 MiB aligned and marked
+// for transparent huge pages, so a 64 MiB grid is 32 TLB entries instead
+// of 16384. Nothing is touched at allocation: the pages are first written
+// by a parallel pass with the static partitioner, which hands each thread
+// one contiguous run of the storage, so on a NUMA host the pages spread
+// evenly over the nodes. That is not the split the tiled stage loops make
+// later (whole z slabs here in linear layout, runs of bricks in Brick<B>,
+// against x and y tiles under each stage's own partitioner), so a stage
+// does not find its tiles on its own node.
+//
+// VOXMAP_HUGEPAGES=0 in the environment marks them MADV_NOHUGEPAGE
+// instead, so they stay 4 KiB pages even where transparent huge pages
+// are always on, to compare the counts sample() reports.
+
+namespace memory {
+
+const size_t HUGE_PAGE = 2 << 20;
+
+inline bool huge_pages() {
+  static bool on = [] {
+    const char *env = getenv("VOXMAP_HUGEPAGES");
+    return !env || strcmp(env, "0") != 0;
+  }();
+  return on;
+}
+
+// page faults and data TLB misses of the whole process so far;
+// dtlb_misses is -1 where perf events are not allowed
+struct counters {
+  long minor_faults, major_faults;
+  long long dtlb_misses;
+
+  counters operator-(const counters &o) const {
+    return {minor_faults - o.minor_faults, major_faults - o.major_faults,
+            dtlb_misses < 0 ? -1 : dtlb_misses - o.dtlb_misses};
+  }
+  std::string str() const {
+    return std::to_string(minor_faults + major_faults) + " page faults, " +
+           (dtlb_misses < 0 ? "n/a" : std::to_string(dtlb_misses)) +
+           " dTLB misses";
+  }
+};
+
+// The TLB counter follows threads created after it is opened, so it is
+// opened by the first allocation, before TBB starts its workers.
+inline int dtlb_counter() {
+  static int fd = [] {
+    perf_event_attr attr = {};
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                  PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }();
+  return fd;
+}
+
+inline counters sample() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  long long misses = -1;
+  if (dtlb_counter() >= 0 &&
+      read(dtlb_counter(), &misses, sizeof misses) != sizeof misses)
+    misses = -1;
+  return {usage.ru_minflt, usage.ru_majflt, misses};
+}
+
+// zero-filled storage of at least n bytes, released with the block;
+// anything under a huge page is left to ordinary lazy faulting
+class block {
+  void *p = nullptr;
+  size_t length = 0;
+
+public:
+  block() = default;
+  explicit block(size_t n) {
+    dtlb_counter();
+    if (n < HUGE_PAGE) {
+      length = n ? n : 1;
+      p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) throw std::bad_alloc();
+      return;
+    }
+    length = (n + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+
+    // over-map by a huge page and trim, to start on a huge page boundary
+    void *m = mmap(nullptr, length + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) throw std::bad_alloc();
+    uintptr_t at = ((uintptr_t)m + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    size_t head = at - (uintptr_t)m;
+    if (head) munmap(m, head);
+    if (HUGE_PAGE - head) munmap((char *)at + length, HUGE_PAGE - head);
+    p = (void *)at;
+
+    madvise(p, length, huge_pages() ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+
+    // first touch, one contiguous run per thread
+    size_t page = huge_pages() ? HUGE_PAGE : 4096;
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, length / page),
+        [&](const tbb::blocked_range<size_t> &r) {
+          for (size_t i = r.begin(); i < r.end(); i++)
+            ((volatile char *)p)[i * page] = 0;
+        },
+        tbb::static_partitioner());
+  }
+  block(const block &) = delete;
+  block &operator=(block &&o) noexcept {
+    std::swap(p, o.p);
+    std::swap(length, o.length);
+    return *this;
+  }
+  ~block() {
+    if (p) munmap(p, length);
+  }
+
+  void *get() const { return p; }
+};
+
+} // namespace memory
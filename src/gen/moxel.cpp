@@ -1,17 +1,26 @@
-#include <cassert>
-#include <cmath>
-#include <fstream>
+#include "voxmap.h"
+#include "snapshot.h"
+#include "raster.h"
+#include "vox.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <iostream>
-#include <iterator>
-#include <sstream>
-#include <string.h>
+#include <set>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-#include "../libs/MagicaVoxel_File_Writer/VoxWriter.h"
-
 using namespace std;
 
+// storage layout of the volumes, as bin/voxmap is built with: the
+// snapshot is mapped as is, so both must agree (see snapshot.h)
+#ifdef VOXMAP_BRICK
+using Layout = Brick<VOXMAP_BRICK>;
+#else
+using Layout = Linear;
+#endif
+
 enum paints {
     Concrete,
     Roof,
@@ -52,72 +61,180 @@ int colorOf(int paint){
     }
 }
 
-int main()
-{
-    string filetype;
-
-    int width;
-    int height;
-    int max;
-
-    string filedesc;
-
-    ifstream f0("maps/pgm/layer0.pgm", ios::binary);
-    ifstream f1("maps/pgm/layer1.pgm", ios::binary);
-    ifstream f2("maps/pgm/layer2.pgm", ios::binary);
-
-    f0 >> filetype >> width >> height >> max;
-    f1 >> filetype >> width >> height >> max;
-    f2 >> filetype >> width >> height >> max;
-
-    getline(f0, filedesc);
-    getline(f1, filedesc);
-    getline(f2, filedesc);
-
-    cout << filetype << endl;
-    cout << width << " x " << height << " x " << max << endl;
+// One pixel of the three layers is one column of the map, in MagicaVoxel
+// palette indices (0 for air, which is also what unknown paints give).
+// The layers store steps of 15: depth is the height of the top block,
+// structure above 13 a pole or wall filling the column below it
+// (two-tone above 15), and paint the top's material. Ground under
+// anything raised is concrete.
+//
+// Columns are kept as planes of bytes, one per field, so pixels can be
+// classified a batch at a time: every step below is branch-free byte
+// arithmetic on whole arrays, which the compiler turns into vector
+// instructions, and only the paint's color is a table lookup.
+struct columns {
+    vector<uint8_t> depth, ground, wall, top;
+
+    explicit columns(size_t n) : depth(n), ground(n), wall(n), top(n) {}
+};
 
-    vector<unsigned char> b0(std::istreambuf_iterator<char>(f0), {});
-    vector<unsigned char> b1(std::istreambuf_iterator<char>(f1), {});
-    vector<unsigned char> b2(std::istreambuf_iterator<char>(f2), {});
+const int BATCH = 64; // pixels per classify() call
 
-    vox::VoxWriter vox;
+// v / 15 for bytes, as a 16-bit multiply and shift
+inline uint8_t fifteenth(uint8_t v) { return v * 137 >> 11; }
 
-    int i = 0;
-    for (int y = 0; y < height; y++)
-    for (int x = 0; x < width; x++)
-    {
-        int depth = b0[i];
-        int structure = b1[i];
-        int paint = b2[i];
+// n pixels from i on, n at most BATCH
+inline void classify(const uint8_t *depth, const uint8_t *structure,
+                     const uint8_t *paint, const uint8_t *color_of,
+                     columns &out, size_t i, int n)
+{
+    uint8_t d[BATCH], s[BATCH], top[BATCH], ground[BATCH], wall[BATCH];
+    for (int k = 0; k < n; k++) d[k] = fifteenth(depth[i + k]);
+    for (int k = 0; k < n; k++) s[k] = fifteenth(structure[i + k]);
+    for (int k = 0; k < n; k++) top[k] = color_of[paint[i + k]];
+    for (int k = 0; k < n; k++) ground[k] = d[k] > 0 ? (uint8_t)Gray : top[k];
+    for (int k = 0; k < n; k++) wall[k] = s[k] > 15 ? (uint8_t)White : s[k] > 13 ? top[k] : 0;
+    // the planes may alias as far as the compiler knows: copy out last
+    copy_n(d, n, &out.depth[i]);
+    copy_n(top, n, &out.top[i]);
+    copy_n(ground, n, &out.ground[i]);
+    copy_n(wall, n, &out.wall[i]);
+}
 
-        depth /= 15;
-        structure /= 15;
-        paint /= 15;
+// Map layers to the palettized volume bin/voxmap maps with --in: the
+// columns are written straight into its grids and saved as a snapshot,
+// with the palette and 2D top view voxmap would derive from a .vox.
+// Rows are classified, and columns filled, in parallel.
+//
+// The layers are data/layer0..2.png of the Krita file given with --ora,
+// flipped, or else layer0..2.pgm in the --pgm directory. --vox path also
+// writes the columns as a MagicaVoxel file, to edit or view them there.
+int main(int argc, char **argv)
+{
+    Args args(argc, argv);
+    string source = args.get("--ora", args.get("--pgm", "maps/pgm"));
+    string path = args.get("--save", "maps/map.vxs");
+
+    vector<raster::image> layers(3);
+    if (args.has("--ora")) {
+        layers = raster::read_ora(source, {"data/layer0.png", "data/layer1.png",
+                                           "data/layer2.png"});
+        parFor(0, 3, [&](int l) { raster::flip(layers[l]); });
+    } else {
+        for (int l = 0; l < 3; l++)
+            layers[l] = pnm::read_pgm(source + "/layer" + to_string(l) + ".pgm");
+    }
 
-        int color = colorOf(paint);
-        if(depth > 0) {
-            vox.AddVoxel(x, y, 0, colorOf(Concrete));
+    int width = layers[0].width();
+    int height = layers[0].height();
+    for (auto &layer : layers)
+        if ((int)layer.width() != width || (int)layer.height() != height)
+            throw runtime_error("moxel: layers in " + source + " differ in size");
+    if (width > X || height > Y)
+        throw runtime_error("moxel: " + to_string(width) + " x " +
+                            to_string(height) + " layers do not fit the " +
+                            to_string(X) + " x " + to_string(Y) + " map");
+
+    cout << width << " x " << height << endl;
+
+    static_assert(sizeof(pnm::gray_pixel) == 1, "gray pixels are bytes");
+    const uint8_t *pixels[3];
+    for (int l = 0; l < 3; l++)
+        pixels[l] = raster::pixels(layers[l]);
+
+    uint8_t color_of[256];
+    for (int v = 0; v < 256; v++) color_of[v] = colorOf(fifteenth(v));
+
+    columns c((size_t)width * height);
+    parFor(0, height, [&](int y) {
+        size_t row = (size_t)y * width;
+        int x = 0;
+        for (; x + BATCH <= width; x += BATCH)
+            classify(pixels[0], pixels[1], pixels[2], color_of, c, row + x, BATCH);
+        classify(pixels[0], pixels[1], pixels[2], color_of, c, row + x, width - x);
+    });
+
+    // the palette voxmap builds: air, then every color used, by RGB value;
+    // a wall shows only below the top, a ground only under a raised top
+    vector<array<bool, 256>> row_used(height);
+    parFor(0, height, [&](int y) {
+        array<bool, 256> &used = row_used[y];
+        used.fill(false);
+        for (size_t i = (size_t)y * width; i < (size_t)(y + 1) * width; i++) {
+            used[c.top[i]] = true;
+            used[c.ground[i]] = true;
+            used[c.wall[i]] |= c.depth[i] > 1;
         }
-        if (structure > 13) { // pole or wall
-
-            vox.AddVoxel(x, y, depth, color);
-
-            if (structure > 15) { // if wall, two-tone
-                color = colorOf(Wall);
-            }
-
-            for (int z = 1; z < depth; z++) {
-                vox.AddVoxel(x, y, z, color);
-            }
-
-        } else {
-            vox.AddVoxel(x, y, depth, color);
+    });
+    auto rgb = vox::default_palette();
+    set<int> used = {0};
+    for (auto &row : row_used)
+        for (int i = 1; i < 256; i++)
+            if (row[i]) used.insert(rgb[i]);
+
+    int pal[256] = {};
+    int pal_size = 0;
+    for (int color : used) pal[pal_size++] = color;
+
+    // MagicaVoxel index to palette index; air is pal_size in col, as in voxmap
+    uint8_t index[256];
+    index[0] = pal_size;
+    for (int i = 1; i < 256; i++)
+        for (int p = 1; p < pal_size; p++)
+            if (pal[p] == rgb[i]) index[i] = p;
+
+    Grid<uint8_t, 1, Layout> col(X, Y, Z); // color, border clamped to the edges
+    Grid<uint8_t, 1, Layout> bin(X, Y, Z); // 1 if block, else 0
+    Grid<int, 0> c2d(X, Y); // color of the top block above z = 0, else pal_size
+    Grid<int, 0> z2d(X, Y); // its z, else 0
+
+    parTiledXY<64, 64>(X, Y, [&](int x, int y) {
+        uint8_t air = pal_size;
+        c2d(x, y) = air;
+        if (x >= width || y >= height) {
+            for (int z = 0; z < Z; z++) col(x, y, z) = air;
+            return;
         }
-
-        i++;
+        size_t i = (size_t)y * width + x;
+        int depth = c.depth[i];
+        uint8_t top = index[c.top[i]];
+        uint8_t ground = index[c.ground[i]];
+        uint8_t wall = index[c.wall[i]];
+        for (int z = 0; z < Z; z++) {
+            uint8_t m = z == depth ? top : z == 0 ? ground : z < depth ? wall : air;
+            col(x, y, z) = m;
+            bin(x, y, z) = m != air;
+        }
+        for (int z = std::min(depth, Z - 1); z > 0; z--)
+            if (col(x, y, z) != air) {
+                c2d(x, y) = col(x, y, z);
+                z2d(x, y) = z;
+                break;
+            }
+    });
+    col.clamp_border();
+
+    snapshot::header h = {};
+    h.dims[0] = X; h.dims[1] = Y; h.dims[2] = Z;
+    h.layout = Layout::id;
+    h.pal_size = pal_size;
+    copy(pal, pal + 255, h.pal);
+    snapshot::save(path, h, {
+        {col.data(), col.bytes()},
+        {bin.data(), bin.bytes()},
+        {c2d.data(), c2d.bytes()},
+        {z2d.data(), z2d.bytes()},
+    });
+
+    cout << pal_size << " colors, saved " << path << endl;
+
+    if (args.has("--vox")) {
+        string vox_path = args.get("--vox", "maps/map.vox");
+        vox::write(vox_path, width, height, Z, [&](int x, int y, int z) {
+            size_t i = (size_t)y * width + x;
+            int depth = c.depth[i];
+            return z == depth ? c.top[i] : z == 0 ? c.ground[i] : z < depth ? c.wall[i] : 0;
+        });
+        cout << "Saved " << vox_path << endl;
     }
-
-    vox.SaveToFile("maps/map.vox");
 }
-
@@ -0,0 +1,420 @@
+#pragma once
+
+#include "voxmap.h"
+#include "libs/pnm.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The raster stages of the map's layers, which used to be Python,
+// ImageMagick and zip runs in the makefile: polygon fill, flip, threshold
+// and edge on grayscale pnm images, PNG in and out, and OpenRaster files
+// (a zip of PNG layers, what Krita opens and saves). Everything stays in
+// memory, filters run rows in parallel, and layers are encoded and
+// decoded in parallel.
+//
+// PNG covers what Krita writes: 8 or 16 bits, gray, RGB, palette, with
+// or without alpha, not interlaced. Color becomes gray by Rec. 709 luma,
+// as in ImageMagick (the layers are painted gray anyway), and alpha is
+// dropped, as converting to PGM did. Zip covers stored and deflated
+// entries, without zip64.
+
+namespace raster {
+
+using image = pnm::pgm_image;
+
+inline uint8_t *pixels(image &img) { return &img.raw_access(0).value; }
+inline const uint8_t *pixels(const image &img) { return &img.raw_access(0).value; }
+
+// top row to bottom (convert -flip)
+inline void flip(image &img) {
+  int w = img.width(), h = img.height();
+  uint8_t *p = pixels(img);
+  parFor(0, h / 2, [&](int y) {
+    std::swap_ranges(p + (size_t)y * w, p + (size_t)(y + 1) * w,
+                     p + (size_t)(h - 1 - y) * w);
+  });
+}
+
+// white above t, black elsewhere (convert -threshold t)
+inline image threshold(const image &in, int t) {
+  image out(in.width(), in.height());
+  const uint8_t *a = pixels(in);
+  uint8_t *b = pixels(out);
+  parFor(0, in.height(), [&](int y) {
+    for (size_t i = (size_t)y * in.width(); i < (size_t)(y + 1) * in.width(); i++)
+      b[i] = a[i] > t ? 255 : 0;
+  });
+  return out;
+}
+
+// 8 times the pixel less its 8 neighbors, clamped to [0, 255], edges
+// repeated past the border (convert -edge 1): on a thresholded image,
+// the white pixels next to black ones
+inline image edge(const image &in) {
+  int w = in.width(), h = in.height();
+  image out(w, h);
+  const uint8_t *a = pixels(in);
+  uint8_t *b = pixels(out);
+  parFor(0, h, [&](int y) {
+    const uint8_t *rows[3] = {a + (size_t)std::max(y - 1, 0) * w,
+                              a + (size_t)y * w,
+                              a + (size_t)std::min(y + 1, h - 1) * w};
+    for (int x = 0; x < w; x++) {
+      int l = std::max(x - 1, 0), r = std::min(x + 1, w - 1);
+      int v = 9 * rows[1][x];
+      for (const uint8_t *row : rows) v -= row[l] + row[x] + row[r];
+      b[(size_t)y * w + x] = std::clamp(v, 0, 255);
+    }
+  });
+  return out;
+}
+
+struct polygon {
+  std::vector<std::pair<double, double>> points; // x, y
+  uint8_t value;
+};
+
+// polygons painted in order, later ones on top, without antialiasing: a
+// pixel takes a polygon's value when its center is inside by the nonzero
+// winding rule, as SVG fills by default (convert +antialias). Each row
+// intersects the edges on its own, so rows run in parallel.
+inline void fill(image &img, const std::vector<polygon> &polygons) {
+  int w = img.width(), h = img.height();
+  uint8_t *p = pixels(img);
+  parFor(0, h, [&](int y) {
+    double center = y + 0.5;
+    std::vector<std::pair<double, int>> crossings; // x, winding direction
+    for (const polygon &poly : polygons) {
+      crossings.clear();
+      size_t n = poly.points.size();
+      for (size_t i = 0; i < n; i++) {
+        auto [x0, y0] = poly.points[i];
+        auto [x1, y1] = poly.points[(i + 1) % n];
+        // half-open in y, so a vertex on the line counts once
+        if ((y0 <= center) == (y1 <= center)) continue;
+        crossings.push_back({x0 + (center - y0) * (x1 - x0) / (y1 - y0),
+                             y1 > y0 ? 1 : -1});
+      }
+      std::sort(crossings.begin(), crossings.end());
+      int winding = 0;
+      for (size_t i = 0; i + 1 < crossings.size(); i++) {
+        winding += crossings[i].second;
+        if (!winding) continue;
+        // the pixels whose centers are in [x_i, x_i+1)
+        int x0 = std::clamp(std::ceil(crossings[i].first - 0.5), 0.0, (double)w);
+        int x1 = std::clamp(std::ceil(crossings[i + 1].first - 0.5), 0.0, (double)w);
+        if (x0 < x1) std::fill(p + (size_t)y * w + x0, p + (size_t)y * w + x1, poly.value);
+      }
+    }
+  });
+}
+
+namespace detail {
+
+inline uint32_t be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+inline void put_be32(std::vector<char> &out, uint32_t v) {
+  for (int shift = 24; shift >= 0; shift -= 8) out.push_back((char)(v >> shift));
+}
+inline uint32_t le(const uint8_t *p, int bytes) {
+  uint32_t v = 0;
+  for (int i = bytes - 1; i >= 0; i--) v = v << 8 | p[i];
+  return v;
+}
+inline void put_le(std::vector<char> &out, uint32_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) out.push_back((char)(v >> 8 * i));
+}
+
+// exactly size bytes out of a zlib stream, or of raw deflate (zip's)
+inline std::vector<uint8_t> inflate_all(const uint8_t *data, size_t n,
+                                        size_t size, bool raw,
+                                        std::string name) {
+  std::vector<uint8_t> out(size);
+  z_stream s = {};
+  inflateInit2(&s, raw ? -MAX_WBITS : MAX_WBITS);
+  s.next_in = (Bytef *)data;
+  s.avail_in = n;
+  s.next_out = out.data();
+  s.avail_out = size;
+  int ret = inflate(&s, Z_FINISH);
+  inflateEnd(&s);
+  if (ret != Z_STREAM_END || s.total_out != size)
+    throw std::runtime_error("raster: bad compressed data in " + name);
+  return out;
+}
+
+const uint8_t PNG_SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+inline int paeth(int a, int b, int c) {
+  int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+  return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+} // namespace detail
+
+inline image read_png(const std::vector<char> &file, std::string name) {
+  using namespace detail;
+  const uint8_t *p = (const uint8_t *)file.data(), *end = p + file.size();
+  if (file.size() < 8 || memcmp(p, PNG_SIGNATURE, 8))
+    throw std::runtime_error("raster: " + name + " is not a PNG");
+  p += 8;
+
+  uint32_t w = 0, h = 0;
+  int depth = 0, type = -1;
+  std::vector<uint8_t> idat, palette;
+  while (p + 12 <= end) {
+    uint32_t n = be32(p);
+    std::string chunk((const char *)p + 4, 4);
+    const uint8_t *data = p + 8;
+    if (n > (size_t)(end - data) - 4)
+      throw std::runtime_error("raster: truncated PNG " + name);
+    if (chunk == "IHDR") {
+      w = be32(data);
+      h = be32(data + 4);
+      depth = data[8];
+      type = data[9];
+      if (data[12]) throw std::runtime_error("raster: interlaced PNG " + name);
+    } else if (chunk == "PLTE") {
+      palette.assign(data, data + n);
+    } else if (chunk == "IDAT") {
+      idat.insert(idat.end(), data, data + n);
+    } else if (chunk == "IEND") {
+      break;
+    }
+    p = data + n + 4;
+  }
+
+  int channels = type == 0 ? 1 : type == 2 ? 3 : type == 3 ? 1 : type == 4 ? 2 : 4;
+  if (type < 0 || type == 1 || type > 6 || (depth != 8 && depth != 16) ||
+      (type == 3 && depth != 8))
+    throw std::runtime_error("raster: unsupported PNG format in " + name);
+  int bpp = channels * depth / 8; // bytes per pixel
+  size_t stride = (size_t)w * bpp;
+  std::vector<uint8_t> raw =
+      inflate_all(idat.data(), idat.size(), (stride + 1) * h, false, name);
+
+  // filters undo row after row, each reading the row above
+  for (size_t y = 0; y < h; y++) {
+    uint8_t *row = &raw[y * (stride + 1)];
+    int filter = *row++;
+    const uint8_t *up = y ? row - (stride + 1) : nullptr;
+    for (size_t i = 0; i < stride; i++) {
+      int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+      int b = up ? up[i] : 0;
+      int c = up && i >= (size_t)bpp ? up[i - bpp] : 0;
+      switch (filter) {
+        case 0: break;
+        case 1: row[i] += a; break;
+        case 2: row[i] += b; break;
+        case 3: row[i] += (a + b) / 2; break;
+        case 4: row[i] += paeth(a, b, c); break;
+        default: throw std::runtime_error("raster: bad PNG filter in " + name);
+      }
+    }
+  }
+
+  image img(w, h);
+  uint8_t *out = pixels(img);
+  int step = depth / 8; // the high byte of 16-bit samples comes first
+  parFor(0, h, [&](int y) {
+    const uint8_t *row = &raw[(size_t)y * (stride + 1) + 1];
+    for (size_t x = 0; x < w; x++) {
+      const uint8_t *px = row + x * bpp;
+      int r = px[0], g = r, b = r;
+      if (type == 3) {
+        if (3 * r + 2 >= (int)palette.size())
+          throw std::runtime_error("raster: bad palette index in " + name);
+        r = palette[3 * r], g = palette[3 * px[0] + 1], b = palette[3 * px[0] + 2];
+      } else if (type == 2 || type == 6) {
+        g = px[step], b = px[2 * step];
+      }
+      out[(size_t)y * w + x] =
+          r == g && g == b ? r : (uint8_t)std::lround(0.2126 * r + 0.7152 * g + 0.0722 * b);
+    }
+  });
+  return img;
+}
+
+// 8-bit gray, each row filtered by its difference to the one above
+inline std::vector<char> write_png(const image &img, int level = Z_DEFAULT_COMPRESSION) {
+  using namespace detail;
+  size_t w = img.width(), h = img.height();
+  const uint8_t *p = pixels(img);
+  std::vector<uint8_t> raw((w + 1) * h);
+  parFor(0, h, [&](int y) {
+    uint8_t *row = &raw[y * (w + 1)];
+    const uint8_t *in = p + y * w, *up = y ? in - w : nullptr;
+    row[0] = up ? 2 : 0;
+    for (size_t x = 0; x < w; x++) row[x + 1] = in[x] - (up ? up[x] : 0);
+  });
+  uLongf size = compressBound(raw.size());
+  std::vector<uint8_t> z(size);
+  if (compress2(z.data(), &size, raw.data(), raw.size(), level) != Z_OK)
+    throw std::runtime_error("raster: deflate failed");
+
+  std::vector<char> out(PNG_SIGNATURE, PNG_SIGNATURE + 8);
+  auto chunk = [&](const char *type, const uint8_t *data, size_t n) {
+    put_be32(out, n);
+    size_t at = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + n);
+    put_be32(out, crc32(0, (const Bytef *)&out[at], n + 4));
+  };
+  uint8_t ihdr[13] = {};
+  for (int i = 0; i < 4; i++) {
+    ihdr[i] = w >> (24 - 8 * i);
+    ihdr[4 + i] = h >> (24 - 8 * i);
+  }
+  ihdr[8] = 8; // bits, then gray, deflate, adaptive filters, no interlace
+  chunk("IHDR", ihdr, sizeof ihdr);
+  chunk("IDAT", z.data(), size);
+  chunk("IEND", nullptr, 0);
+  return out;
+}
+
+// every file of a zip archive, by name
+inline std::map<std::string, std::vector<char>> read_zip(std::string path) {
+  using namespace detail;
+  std::ifstream in(path, std::ios::binary);
+  if (!in) throw std::runtime_error("raster: cannot open " + path);
+  std::vector<char> file(std::istreambuf_iterator<char>(in), {});
+  const uint8_t *z = (const uint8_t *)file.data();
+  size_t n = file.size();
+
+  // the end of central directory record, behind at most a 64 KiB comment
+  size_t eocd = n;
+  for (size_t i = n < 22 ? 0 : n - 21; i-- > 0 && n - i <= 22 + 65535;)
+    if (le(z + i, 4) == 0x06054b50) {
+      eocd = i;
+      break;
+    }
+  if (eocd == n) throw std::runtime_error("raster: " + path + " is not a zip");
+
+  std::map<std::string, std::vector<char>> files;
+  size_t at = le(z + eocd + 16, 4);
+  for (int k = le(z + eocd + 10, 2); k > 0; k--) {
+    if (at + 46 > n || le(z + at, 4) != 0x02014b50)
+      throw std::runtime_error("raster: bad central directory in " + path);
+    int method = le(z + at + 10, 2);
+    uint32_t crc = le(z + at + 16, 4);
+    size_t packed = le(z + at + 20, 4), size = le(z + at + 24, 4);
+    int name_length = le(z + at + 28, 2);
+    std::string name((const char *)z + at + 46, name_length);
+    size_t local = le(z + at + 42, 4);
+    at += 46 + name_length + le(z + at + 30, 2) + le(z + at + 32, 2);
+
+    if (local + 30 > n || le(z + local, 4) != 0x04034b50)
+      throw std::runtime_error("raster: bad entry " + name + " in " + path);
+    size_t data = local + 30 + le(z + local + 26, 2) + le(z + local + 28, 2);
+    if (data + packed > n)
+      throw std::runtime_error("raster: truncated entry " + name + " in " + path);
+    std::vector<char> &out = files[name];
+    if (method == 0) {
+      out.assign(file.begin() + data, file.begin() + data + packed);
+    } else if (method == 8) {
+      std::vector<uint8_t> bytes = inflate_all(z + data, packed, size, true, name);
+      out.assign(bytes.begin(), bytes.end());
+    } else {
+      throw std::runtime_error("raster: unsupported compression of " + name);
+    }
+    if (crc32(0, (const Bytef *)out.data(), out.size()) != crc)
+      throw std::runtime_error("raster: bad checksum of " + name + " in " + path);
+  }
+  return files;
+}
+
+// files stored as they are, in the order given, as one write
+inline void write_zip(std::string path,
+                      const std::vector<std::pair<std::string, std::vector<char>>> &files) {
+  using namespace detail;
+  std::vector<char> out, directory;
+  for (auto &[name, data] : files) {
+    uint32_t crc = crc32(0, (const Bytef *)data.data(), data.size());
+    auto header = [&](std::vector<char> &h, bool central) {
+      put_le(h, central ? 0x02014b50 : 0x04034b50, 4);
+      if (central) put_le(h, 20, 2); // made by
+      put_le(h, 20, 2); // version needed
+      put_le(h, 0, 2); // flags
+      put_le(h, 0, 2); // stored
+      put_le(h, 0, 2); // time
+      put_le(h, 0x21, 2); // date, 1980-01-01
+      put_le(h, crc, 4);
+      put_le(h, data.size(), 4);
+      put_le(h, data.size(), 4);
+      put_le(h, name.size(), 2);
+      put_le(h, 0, 2); // extra
+      if (central) {
+        put_le(h, 0, 2); // comment
+        put_le(h, 0, 2); // disk
+        put_le(h, 0, 2); // internal attributes
+        put_le(h, 0, 4); // external attributes
+        put_le(h, out.size(), 4);
+      }
+      h.insert(h.end(), name.begin(), name.end());
+    };
+    header(directory, true);
+    header(out, false);
+    out.insert(out.end(), data.begin(), data.end());
+  }
+  size_t offset = out.size();
+  out.insert(out.end(), directory.begin(), directory.end());
+  put_le(out, 0x06054b50, 4);
+  put_le(out, 0, 4); // disks
+  put_le(out, files.size(), 2);
+  put_le(out, files.size(), 2);
+  put_le(out, directory.size(), 4);
+  put_le(out, offset, 4);
+  put_le(out, 0, 2); // comment
+
+  std::ofstream file(path, std::ios::binary);
+  file.exceptions(std::fstream::badbit | std::fstream::failbit);
+  file.write(out.data(), out.size());
+}
+
+// the layers of an OpenRaster file by their file names (data/layer0.png,
+// ...), decoded in parallel
+inline std::vector<image> read_ora(std::string path, std::vector<std::string> names) {
+  auto files = read_zip(path);
+  std::vector<image> layers(names.size());
+  for (auto &name : names)
+    if (!files.count(name))
+      throw std::runtime_error("raster: " + path + " has no " + name);
+  parFor(0, names.size(), [&](int i) { layers[i] = read_png(files[names[i]], names[i]); });
+  return layers;
+}
+
+// an OpenRaster file of same-sized layers, named data/<name>.png, the
+// first one on top; encoded in parallel
+inline void write_ora(std::string path,
+                      const std::vector<std::pair<std::string, const image *>> &layers) {
+  int w = layers.at(0).second->width(), h = layers[0].second->height();
+  std::string stack = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                      "<image version=\"0.0.3\" w=\"" + std::to_string(w) +
+                      "\" h=\"" + std::to_string(h) + "\">\n<stack>\n";
+  for (auto &[name, layer] : layers)
+    stack += " <layer name=\"" + name + "\" src=\"data/" + name + ".png\"/>\n";
+  stack += "</stack>\n</image>\n";
+
+  // mimetype first and stored, so the type shows at a fixed offset
+  std::string mimetype = "image/openraster";
+  std::vector<std::pair<std::string, std::vector<char>>> files(2 + layers.size());
+  files[0] = {"mimetype", std::vector<char>(mimetype.begin(), mimetype.end())};
+  files[1] = {"stack.xml", std::vector<char>(stack.begin(), stack.end())};
+  parFor(0, layers.size(), [&](int i) {
+    files[2 + i] = {"data/" + layers[i].first + ".png", write_png(*layers[i].second)};
+  });
+  write_zip(path, files);
+}
+
+} // namespace raster
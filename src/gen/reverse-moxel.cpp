@@ -1,27 +1,25 @@
 #include "voxmap.h"
-#include "../libs/pnm.hpp"
+#include "vox.h"
+#include "libs/pnm.hpp"
 #include <cassert>
-#include <set>
-
-#include "../libs/MagicaVoxel_File_Writer/VoxWriter.h"
-
+#include <cstdint>
 
+// maps/texture.ppm, the map's z slices stacked top to bottom, back to a
+// MagicaVoxel file: red 0 marks a block, green its color. Slice z is
+// height Z - z, so the file is Z + 1 tall with nothing at 0.
 int main()
 {
     using namespace pnm::literals;
 
     pnm::image<pnm::rgb_pixel> img = pnm::read("maps/texture.ppm");
-
-    vox::VoxWriter vox;
-
-    FOR_XYZ {
-        if(int(img[Y*z + y][x].red) == 0) {
-            int g = 256 - int(img[Y*z + y][x].green);
-            g = (g > 240) ? 248 : (g > 220) ? 236 : (g > 155) ? 159 : (g > 150) ? 153 : (g>100) ? 106 : (g>20) ? 30 : 1;
-            vox.AddVoxel(x, y, Z-z, g);
-        }
-    }
-
-    vox.SaveToFile("maps/map.vox");
+    assert((int)img.width() >= X && (int)img.height() >= Y * Z);
+
+    vox::write("maps/map.vox", X, Y, Z + 1, [&](int x, int y, int h) -> uint8_t {
+        if (h == 0) return 0;
+        const pnm::rgb_pixel &px = img.raw_access((size_t)(Y*(Z - h) + y) * img.width() + x);
+        if (int(px.red) != 0) return 0;
+        int g = 256 - int(px.green);
+        g = (g > 240) ? 248 : (g > 220) ? 236 : (g > 155) ? 159 : (g > 150) ? 153 : (g>100) ? 106 : (g>20) ? 30 : 1;
+        return g;
+    });
 }
-
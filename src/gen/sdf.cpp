@@ -1,106 +1,78 @@
 #include "voxmap.h"
+#include "gzstream.h"
+#include "codec.h"
+#include "filter.h"
+#include "vox.h"
+#include "snapshot.h"
+#include "spans.h"
+#include "sparse.h"
+#include "stages.h"
+#include "tune.h"
+#include <tbb/flow_graph.h>
+#include <fcntl.h>
 #include <math.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <iostream>
+#include <cstdio>
 #include <cstdlib>
 #include <fstream>
+#include <functional>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <memory>
 #include <set>
-
-#define MAP_BIN
-#define VERTEX_BIN
-#define VERTEX2D_BIN
-#define NOISE_BIN
+#include <sstream>
+#include <string>
+
+// storage layout of the volumes: -DVOXMAP_BRICK=8 for 8^3 bricks,
+// linear otherwise (compare them with bin/bench)
+#ifdef VOXMAP_BRICK
+using Layout = Brick<VOXMAP_BRICK>;
+#else
+using Layout = Linear;
+#endif
 
 const int MAX = 255;
-const int O = 2; // Two octants, down(0) and up(1)
 
 const int GLASS = 8505300;
 
 int pal[MAX]; // palette
 std::set<int> pal_set; // palette set
 int pal_size;
-int col[X][Y][Z]; // color
-int bin[X][Y][Z]; // 1 if block, else 0
-int sum[X][Y][Z]; // summed volume table
-int sdf[X][Y][Z][O]; // radius of largest fittng cube centered at block
-
-int c2d[X][Y]; // 2d color
-int z2d[X][Y]; // 2d z
-
-std::ifstream in("maps/map.txt");
-std::ofstream o_vertex("out/vertex.bin", std::ios::binary);
-std::ofstream o_map("out/map.bin", std::ios::binary);
-std::ofstream o_vertex2d("out/vertex2d.bin", std::ios::binary);
-
-// clamped sum access
-auto csum = [](int x, int y, int z)
-{ 
-	return sum
-		[std::clamp(x,0,X-1)]
-		[std::clamp(y,0,Y-1)]
-		[std::clamp(z,0,Z-1)];
-};
 
-// clamped col access
-auto ccol = [](int x, int y, int z)
-{ 
-	return col
-		[std::clamp(x,0,X-1)]
-		[std::clamp(y,0,Y-1)]
-		[std::clamp(z,0,Z-1)];
-};
+// the map texture's texels, in upload order: radius of largest fittng
+// cube centered at block down (R) and up (G), color (B), 0 (A)
+using Texels = Grid<std::array<uint8_t, 4>, 0, ZYX>;
 
-// clamped csdf access
-auto csdf = [](int x, int y, int z, int o)
-{ 
-	return sdf
-		[std::clamp(x,0,X-1)]
-		[std::clamp(y,0,Y-1)]
-		[std::clamp(z,0,Z-1)]
-		[o];
-};
+gz::ofstream o_vertex;
+gz::ofstream o_vertex2d;
 
-auto vol = [](
-		int x0, int y0, int z0,
-		int x1, int y1, int z1
-		)
+// vertices go to byte buffers first, so meshes can be built in pieces
+// in parallel and still written out in order
+auto o_vertex_8 = [](std::vector<char> &out, int x)
 {
-	x0--;
-	y0--;
-	z0--;
-	return 0
-		- csum(x1, y1, z0)
-		- csum(x1, y0, z1)
-		- csum(x0, y1, z1)
-
-		+ csum(x1, y1, z1)
-
-		+ csum(x0, y0, z1)
-		+ csum(x0, y1, z0)
-		+ csum(x1, y0, z0)
-
-		- csum(x0, y0, z0);
+	out.push_back((char)(x & 0xFF));
 };
-
-auto o_vertex_8 = [](int x)
+auto o_vertex_16 = [](std::vector<char> &out, int x) // Split 2-byte ints
 {
-	o_vertex.put((char)(x & 0xFF));
+	o_vertex_8(out, x);
+	o_vertex_8(out, x >> 8);
 };
-auto o_vertex_16 = [](int x) // Split 2-byte ints
+auto vert = [](std::vector<char> &out, int x, int y, int z, int dx, int dy, int dz, int color, int normal, int id)
 {
-	o_vertex_8(x);
-	o_vertex_8(x >> 8);
-};
-auto vert = [](int x, int y, int z, int dx, int dy, int dz, int color, int normal, int id)
-{
-	o_vertex_16(x); o_vertex_16(y); o_vertex_16(z);
-	o_vertex_16(dx); o_vertex_16(dy); o_vertex_16(dz);
-	o_vertex_8(color);
-	o_vertex_8(normal);
-	o_vertex_8(id);
-	o_vertex_8(0);
+	o_vertex_16(out, x); o_vertex_16(out, y); o_vertex_16(out, z);
+	o_vertex_16(out, dx); o_vertex_16(out, dy); o_vertex_16(out, dz);
+	o_vertex_8(out, color);
+	o_vertex_8(out, normal);
+	o_vertex_8(out, id);
+	o_vertex_8(out, 0);
 };
 auto tri = [](
+		std::vector<char> &out,
 		int x, int y, int z,
 		int dx0, int dy0, int dz0,
 		int dx1, int dy1, int dz1,
@@ -108,16 +80,17 @@ auto tri = [](
 		int color, int normal, int id
 		)
 {
-	vert(x, y, z, dx0, dy0, dz0, color, normal, id);
+	vert(out, x, y, z, dx0, dy0, dz0, color, normal, id);
 	if(normal%2) {
-		vert(x, y, z, dx2, dy2, dz2, color, normal, id);
-		vert(x, y, z, dx1, dy1, dz1, color, normal, id);
+		vert(out, x, y, z, dx2, dy2, dz2, color, normal, id);
+		vert(out, x, y, z, dx1, dy1, dz1, color, normal, id);
 	} else {
-		vert(x, y, z, dx1, dy1, dz1, color, normal, id);
-		vert(x, y, z, dx2, dy2, dz2, color, normal, id);
+		vert(out, x, y, z, dx1, dy1, dz1, color, normal, id);
+		vert(out, x, y, z, dx2, dy2, dz2, color, normal, id);
 	}
 };
 auto quad = [](
+		std::vector<char> &out,
 		int x, int y, int z,
 		int dx0, int dy0, int dz0,
 		int dx1, int dy1, int dz1,
@@ -125,6 +98,7 @@ auto quad = [](
 		)
 {
 	tri(
+			out,
 			x, y, z,
 			0, 0, 0,
 			dx0, dy0, dz0,
@@ -132,6 +106,7 @@ auto quad = [](
 			color, normal, id
 		);
 	tri(
+			out,
 			x, y, z,
 			dx1, dy1, dz1,
 			dx0, dy0, dz0,
@@ -142,339 +117,1055 @@ auto quad = [](
 
 
 // 2D versions of the above
-auto o_vertex2d_8 = [](int x)
+auto o_vertex2d_8 = [](std::vector<char> &out, int x)
 {
-	o_vertex2d.put((char)(x & 0xFF));
+	out.push_back((char)(x & 0xFF));
 };
-auto o_vertex2d_16 = [](int x) // Split 2-byte ints
+auto o_vertex2d_16 = [](std::vector<char> &out, int x) // Split 2-byte ints
 {
-	o_vertex2d_8(x);
-	o_vertex2d_8(x >> 8);
+	o_vertex2d_8(out, x);
+	o_vertex2d_8(out, x >> 8);
 };
-auto vert2d = [](int x, int y, int dx, int dy, int color, int id)
+auto vert2d = [](std::vector<char> &out, int x, int y, int dx, int dy, int color, int id)
 {
-	o_vertex2d_16(x); o_vertex2d_16(y); o_vertex2d_16(0);
-	o_vertex2d_16(dx); o_vertex2d_16(dy); o_vertex2d_16(0);
-	o_vertex2d_8(color);
-	o_vertex2d_8(0);
-	o_vertex2d_8(id);
-	o_vertex2d_8(0);
+	o_vertex2d_16(out, x); o_vertex2d_16(out, y); o_vertex2d_16(out, 0);
+	o_vertex2d_16(out, dx); o_vertex2d_16(out, dy); o_vertex2d_16(out, 0);
+	o_vertex2d_8(out, color);
+	o_vertex2d_8(out, 0);
+	o_vertex2d_8(out, id);
+	o_vertex2d_8(out, 0);
 };
-auto tri2d = [](int x, int y, int dx0, int dy0, int dx1, int dy1, int dx2, int dy2, int color, int id)
+auto tri2d = [](std::vector<char> &out, int x, int y, int dx0, int dy0, int dx1, int dy1, int dx2, int dy2, int color, int id)
 {
-	vert2d(x, y, dx0, dy0, color, id);
-	vert2d(x, y, dx1, dy1, color, id);
-	vert2d(x, y, dx2, dy2, color, id);
+	vert2d(out, x, y, dx0, dy0, color, id);
+	vert2d(out, x, y, dx1, dy1, color, id);
+	vert2d(out, x, y, dx2, dy2, color, id);
 };
-auto quad2d = [](int x, int y, int dx0, int dy0, int dx1, int dy1, int color, int id) 
+auto quad2d = [](std::vector<char> &out, int x, int y, int dx0, int dy0, int dx1, int dy1, int color, int id) 
 {
-	tri2d(x, y, 0, 0, dx0, dy0, dx1, dy1, color, id);
-	tri2d(x, y, dx1, dy1, dx0, dy0, dx0+dx1, dy0+dy1, color, id);
+	tri2d(out, x, y, 0, 0, dx0, dy0, dx1, dy1, color, id);
+	tri2d(out, x, y, dx1, dy1, dx0, dy0, dx0+dx1, dy0+dy1, color, id);
 };
 
-int main()
+void print_palette()
 {
-	// so nothing fails silently
-	in.exceptions(std::fstream::badbit);
-	o_map.exceptions(std::fstream::badbit);
-	o_vertex.exceptions(std::fstream::badbit);
-	
-	std::cout << "Loading voxel map..." << std::flush;
+	std::cout << "  return ";
+	for (int i = 0; i < pal_size; i++) {
+		std::cout << "p==" << i << "?";
+		std::cout << "vec3(";
+		std::cout << float((pal[i] >> 16) & 0xFF)/255.0 << ",";
+		std::cout << float((pal[i] >> 8) & 0xFF)/255.0 << ",";
+		std::cout << float((pal[i] >> 0) & 0xFF)/255.0 << "):";
+	}
+	std::cout << "vec3(1);" << std::endl;
+}
 
-	// Skip first 3 lines
-	for(int i = 0; i < 3; i++) in.ignore(256, '\n');
+std::vector<char> skybox()
+{
+	std::vector<char> sky;
+	quad(
+		sky,
+		0, 0, Y,
+		X, 0, 0,
+		0, Y, 0,
+		0, 1, 1
+	);
+	quad(
+		sky,
+		0, 0, 0,
+		X, 0, 0,
+		0, 0, Y,
+		0, 1, 1
+	);
+	quad(
+		sky,
+		X, 0, 0,
+		0, Y, 0,
+		0, 0, Y,
+		0, 1, 1
+	);
+	quad(
+		sky,
+		X, Y, 0,
+		-X, 0, 0,
+		0, 0, Y,
+		0, 1, 1
+	);
+	quad(
+		sky,
+		0, Y, 0,
+		0,-Y, 0,
+		0, 0, Y,
+		0, 1, 1
+	);
+	return sky;
+}
 
-	// Read input stream
-	pal_set.insert(0);
-	for (
-			int x, y, z, color;
-			in >> std::dec >> x >> y >> z >> std::hex >> color;
-		 ) {
+// greedy 2d mesh of one color, where top(x, y) is the color seen from above
+void mesh2d(std::vector<char> &out, int color, auto top)
+{
+	out.clear();
+
+	Grid<bool, 0> mask(X, Y);
+	forXY([&](int x, int y){
+		mask(x, y) = top(x, y) == color;
+	});
 
-		x += 512; y += 5; z += 0;
-		if(color == GLASS) color += 0x1000000;
-		pal_set.insert(color);
+	forXY([&](int x, int y) {
+		int k = 0, l = 0, w = 0, h = 0;
 
-		col[x][y][z] = color;
-		bin[x][y][z] = 1;
+		if(!mask(x, y)) return;
+		for(w = 1; x+w < X && mask(x+w, y); w++) continue;
 
-		if(z > z2d[x][y]) {
-			c2d[x][y] = color;
-			z2d[x][y] = z;
+		for(h = 1; y+h < Y; h++)
+		for(k = 0; k < w; k++)
+		{
+			if(!mask(x+k, y+h)) goto break2;
 		}
-	}
+		break2:
 
-	in.close();
+		// glass material has id=2
+		int id = color == pal_size-1 ? 2 : 0;
+		quad2d(out, x, y, w, 0, 0, h, color, id);
 
-	std::cout << "Done." << std::endl;
+		for (l = 0; l < h; l++)
+		for (k = 0; k < w; k++)
+		{
+			mask(x+k, y+l) = false;
+		}
+	});
+}
 
-	std::cout << "Generating palette..." << std::endl;
+// a grid read in map coordinates, its x = 0 being the map's x0
+template <typename G>
+struct Shifted {
+	const G &grid;
+	int x0;
+	int nx = X, ny = Y, nz = Z;
 
+	auto &operator()(int x, int y, int z) const { return grid(x - x0, y, z); }
+};
+
+// A snapshot read in place, for the paths that stream the map through
+// in x slabs instead of loading it: pages are only read as slabs need
+// them, and dropped once no later slab will.
+struct Mapped {
+	static constexpr size_t CELLS = (size_t)(X + 2) * (Y + 2) * (Z + 2);
+
+	snapshot::mapping file;
+	Grid<uint8_t> col, bin;
+	Grid<int, 0> c2d;
+
+	Mapped(std::string path)
+		: file(check(path)),
+		  col(X, Y, Z, file.get(snapshot::COL, CELLS)),
+		  bin(X, Y, Z, file.get(snapshot::BIN, CELLS)),
+		  c2d(X, Y, 1, file.get(snapshot::C2D, X * Y * sizeof(int)))
 	{
-		std::cout << "  return ";
-		int i = 0;
-		for (int color : pal_set) {
-			std::cout << "p==" << i << "?";
-			std::cout << "vec3(";
-			std::cout << float((color >> 16) & 0xFF)/255.0 << ",";
-			std::cout << float((color >> 8) & 0xFF)/255.0 << ",";
-			std::cout << float((color >> 0) & 0xFF)/255.0 << "):";
-			pal[i] = color;
-			i++;
-		}
-		pal_size = i;
-		std::cout << "vec3(1);" << std::endl;
+		const snapshot::header &h = *file.h;
+		if(h.dims[0] != X || h.dims[1] != Y || h.dims[2] != Z)
+			throw std::runtime_error(path + " has different map dimensions");
+		if(h.layout != Linear::id)
+			throw std::runtime_error("slabs are streamed from a linear snapshot only");
+		pal_size = h.pal_size;
+		std::copy(h.pal, h.pal + MAX, pal);
 	}
 
-	parXYZ([](int x, int y, int z){
-		int i = 1;
-		for (; i < MAX && pal[i] != col[x][y][z]; i++) continue;
-		col[x][y][z] = i;
-	});
+	static std::string check(std::string path) {
+		if(!path.ends_with(".vxs"))
+			throw std::runtime_error("streaming reads a snapshot: make maps/map.vxs, then --in maps/map.vxs");
+		return path;
+	}
 
-	parXY([](int x, int y){
-		int i = 1;
-		for (; i < MAX && pal[i] != c2d[x][y]; i++) continue;
-		c2d[x][y] = i;
-	});
+	// done with everything before column x
+	void release(int x) const {
+		size_t done = x >= X ? CELLS : col.index(x, -1, -1);
+		file.release(col.data(), done);
+		file.release(bin.data(), done);
+	}
+};
 
-	std::cout << "Done." << std::endl;
+// 3D mesh pieces, kept in a temporary file as slabs finish them and
+// copied out color by color at the end
+class Spill {
+	std::unique_ptr<FILE, int (*)(FILE *)> file{std::tmpfile(), std::fclose};
+	std::vector<std::vector<std::pair<long, size_t>>> pieces;
 
-#ifdef VERTEX_BIN
+public:
+	Spill() : pieces(pal_size) {
+		if(!file) throw std::runtime_error("cannot open a spill file");
+	}
 
-	std::cout << "Writing to 3D vertex file..." << std::flush;
+	void put(int color, const std::vector<char> *chunks, int n) {
+		long at = std::ftell(file.get());
+		size_t size = 0;
+		for(int c = 0; c < n; c++) {
+			if(std::fwrite(chunks[c].data(), 1, chunks[c].size(), file.get()) != chunks[c].size())
+				throw std::runtime_error("cannot write the spill file");
+			size += chunks[c].size();
+		}
+		pieces[color].push_back({at, size});
+	}
 
-	// Draw skybox
-	{
-		quad(
-			0, 0, Y,
-			X, 0, 0,
-			0, Y, 0,
-			0, 1, 1
-		);
-		quad(
-			0, 0, 0,
-			X, 0, 0,
-			0, 0, Y,
-			0, 1, 1
-		);
-		quad(
-			X, 0, 0,
-			0, Y, 0,
-			0, 0, Y,
-			0, 1, 1
-		);
-		quad(
-			X, Y, 0,
-			-X, 0, 0,
-			0, 0, Y,
-			0, 1, 1
-		);
-		quad(
-			0, Y, 0,
-			0,-Y, 0,
-			0, 0, Y,
-			0, 1, 1
-		);
+	size_t size(int color) const {
+		size_t size = 0;
+		for(auto [at, n] : pieces[color]) size += n;
+		return size;
 	}
 
-	// https://gist.github.com/Vercidium/a3002bd083cce2bc854c9ff8f0118d33
-	// 3d vertex mesh
-	
-	for(int color = 0; color < pal_size; color++)
-	forChunkXYZ([&](int cx, int cy, int cz) {
-		for(int d = 0; d < 3; d++) // dimensions
-		for(int normal = 0; normal < 2; normal++)
-		{
-			int i = 0, j = 0, k = 0, l = 0, w = 0, h = 0;
-			int u = (d + 1) % 3;
-			int v = (d + 2) % 3;
-
-			int p[3] = { 0, 0, 0 };
-			int n[3] = { 0, 0, 0 };
-
-			bool mask[CHUNK][CHUNK];
-			n[d] = 1;
-
-			for(p[d] = -1; p[d] < CHUNK;) {
-				for(p[v] = 0; p[v] < CHUNK; p[v]++)
-				for(p[u] = 0; p[u] < CHUNK; p[u]++) {
-					bool block = color == ccol(cx+p[0],      cy+p[1],      cz+p[2]     );
-					bool ahead = color == ccol(cx+p[0]+n[0], cy+p[1]+n[1], cz+p[2]+n[2]);
-
-					mask[p[v]][p[u]] =
-							(normal==0 && block && !ahead) || 
-							(normal==1 && !block && ahead)
-					;
-				}
-				
-				p[d]++;
-
-				for(j = 0; j < CHUNK; j++)
-				for(i = 0; i < CHUNK; i++)
-				{
-					if(!mask[j][i]) continue;
-
-					for(w=1; i+w < CHUNK && mask[j][i+w]; w++) continue;
-
-					for(h = 1; j + h < CHUNK; h++)
-					for(k = 0; k < w; k++)
-					{
-						if(!mask[j+h][i+k]) goto break2;
-					}
-					break2:
-
-					p[u] = i;
-					p[v] = j;
-
-					int du[3] = {0, 0, 0};
-					int dv[3] = {0, 0, 0};
-
-					du[u] = w;
-					dv[v] = h;
-
-					// glass material has id=2
-					int id = color == pal_size-1 ? 2 : 0;
-					quad(
-							cx+p[0], cy+p[1], cz+p[2],
-							du[0], du[1], du[2],
-							dv[0], dv[1], dv[2],
-							color, d*2 + normal, id
-						 );
-
-					for (l = 0; l < h; l++)
-					for (k = 0; k < w; k++)
-					{
-						mask[j+l][i+k] = false;
-					}
-
-					i--;
-					i += w;
-				}
+	// write(data, size) for each piece of the color, in order
+	void copy(int color, auto write) const {
+		std::vector<char> piece;
+		for(auto [at, size] : pieces[color]) {
+			piece.resize(size);
+			std::fseek(file.get(), at, SEEK_SET);
+			if(std::fread(piece.data(), 1, size, file.get()) != size)
+				throw std::runtime_error("cannot read the spill file");
+			write(piece.data(), size);
+		}
+		std::fseek(file.get(), 0, SEEK_END);
+	}
+};
+
+// Slabs get a halo of HALO columns either side: the SDF's cubes are
+// never wider (nor its radii larger) than Z, and meshing looks one
+// column past the slab.
+const int HALO = Z;
+
+// the widest slab, in whole chunks, whose volumes fit in budget bytes:
+// per column of x, a window of col, bin and sum plus the snapshot pages
+// they were copied from, and a slab's texels; halos and carry once
+int slab_width(size_t budget)
+{
+	size_t window_column = (size_t)(Y + 2) * (Z + 2) * (1 + 1 + sizeof(int) + 2);
+	size_t slab_column = window_column + (size_t)Y * Z * sizeof(Texels::value_type);
+	size_t fixed = (size_t)X * Y * sizeof(int) + (2 * HALO + 2) * window_column + slab_column;
+	int width = budget > fixed ? (budget - fixed) / slab_column / CHUNK * CHUNK : 0;
+	if(width < CHUNK)
+		throw std::runtime_error("--max-memory: one slab needs at least " +
+				std::to_string(((fixed + CHUNK * slab_column) >> 20) + 1) + " MiB");
+	std::cout << "Slabs of " << std::min(width, X) << " columns, about "
+		<< ((fixed + std::min(width, X) * slab_column) >> 20) << " MiB each" << std::endl;
+	return std::min(width, X);
+}
+
+// Columns [begin, end) of the map, width at a time, left to right. Each
+// slab is copied into a window with its halos. The SDF bound at a slab's
+// first column reads the column before it, which is carried over from
+// the slab before; the first slab, when it isn't the map's, is preceded
+// by HALO columns computed only for that. Their own bounds start from
+// nothing. Above z = 0 a bound at column x reaches back z columns to the
+// z = 0 plane, whose clamped bound reads along the plane itself; there a
+// radius moves by at most one per column towards the cube that fits, so
+// it has caught up with the in-core one well within the HALO columns.
+// With --max-memory alone, begin is 0 and every output is byte for byte
+// the in-core one; --tiles workers match it on every map tried.
+//
+// row(x0, x1, y, z, texels) gets each finished row of texels, and each
+// color's chunks go to spill in order.
+void slabs(const Mapped &in, const tune::profile &profile, int begin, int end,
+		int width, bool with_map, bool with_vertex, auto row, Spill &spill)
+{
+	// column 0 carries the last column of the slab before
+	Texels texels(width + 1, Y, Z);
+	const int CY = Y / CHUNK, CZ = Z / CHUNK;
+
+	int start = with_map ? std::max(0, begin - HALO) : begin;
+	for(int x0 = start, x1; x0 < end; x0 = x1) {
+		auto clock = std::chrono::steady_clock::now();
+		auto before = memory::sample();
+		x1 = std::min(x0 < begin ? begin : end, x0 + width);
+		bool output = x0 >= begin;
+		int wx0 = std::max(0, x0 - HALO), wx1 = std::min(X, x1 + HALO);
+
+		Grid<uint8_t> wcol(wx1 - wx0, Y, Z);
+		Grid<uint8_t> wbin(wx1 - wx0, Y, Z);
+		wcol.for_each([&](int x, int y, int z) {
+			wcol(x, y, z) = in.col(wx0 + x, y, z);
+			wbin(x, y, z) = in.bin(wx0 + x, y, z);
+		});
+		// right at the map's edges; inside it, past the halo, never read
+		wcol.clamp_border();
+		Shifted<Grid<uint8_t>> volume = {wcol, wx0};
+
+		if(with_map) {
+			Grid<int> wsum(wx1 - wx0, Y, Z);
+			tune::run(profile["summed"], [&]() { stages::summed(wbin, wsum); });
+
+			// blocks keep a radius of 0, as in a new grid
+			Shifted<Texels> sdf = {texels, x0 - 1};
+			parFor(0, Z, [&](int z) {
+				for(int y = 0; y < Y; y++)
+					std::fill(&sdf(x0, y, z), &sdf(x1, y, z), Texels::value_type());
+			});
+			tune::run(profile["distance"], [&]() {
+				stages::distance(
+						[&](int x, int y, int z) { return wbin(x - wx0, y, z); },
+						[&](int bx0, int by0, int bz0, int bx1, int by1, int bz1) {
+							return stages::volume(wsum, bx0 - wx0, by0, bz0, bx1 - wx0, by1, bz1) == 0;
+						},
+						sdf, x0, x1);
+				parFor(0, Z, [&](int z) {
+					for(int y = 0; y < Y; y++)
+					for(int x = x0; x < x1; x++)
+						sdf(x, y, z)[2] = volume(x, y, z);
+				});
+			});
+
+			for(int z = 0; z < Z; z++)
+			for(int y = 0; y < Y; y++) {
+				if(output) row(x0, x1, y, z, &texels(1, y, z));
+				texels(0, y, z) = texels(x1 - x0, y, z);
 			}
 		}
+
+		if(with_vertex && output) {
+			int n = (x1 - x0) / CHUNK * CY * CZ;
+			std::vector<std::vector<char>> chunks(pal_size * n);
+			tune::run(profile["mesh3d"], [&]() {
+				parFor(0, (int) chunks.size(), [&](int i) {
+					int color = i / n, c = i % n;
+					stages::chunk(volume, pal_size, color,
+							x0 + c / (CY * CZ) * CHUNK, c / CZ % CY * CHUNK, c % CZ * CHUNK,
+							[&](auto... args) { quad(chunks[i], args...); });
+				});
+			});
+			for(int color = 0; color < pal_size; color++)
+				spill.put(color, &chunks[color * n], n);
+		}
+
+		// no later window starts before x1 - HALO
+		in.release(x1 == end ? X : x1 - HALO);
+
+		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - clock).count();
+		std::cout << "  columns " << x0 << " to " << x1 << (output ? "" : " (halo)")
+			<< ": done in " << ms << " ms, " << (memory::sample() - before).str() << std::endl;
+	}
+}
+
+// 2D vertex file from the snapshot's c2d, colors in parallel
+void write_mesh2d(const Mapped &in, const tune::profile &profile)
+{
+	std::vector<std::vector<char>> colors(pal_size);
+	tune::run(profile["mesh2d"], [&]() {
+		parFor(0, pal_size, [&](int color) {
+			mesh2d(colors[color], color, [&](int x, int y) { return in.c2d(x, y); });
+		});
 	});
+	for(auto &color : colors) o_vertex2d.write(color.data(), color.size());
+	o_vertex2d.close();
+}
+
+void reject(const Args &args, std::string mode)
+{
+	for(std::string flag : {"--filter", "--spans", "--sparse", "--tune"})
+		if(args.has(flag))
+			throw std::runtime_error(mode + " does not support " + flag);
+}
 
+// The out-of-core path, for maps that don't fit in memory: bin/voxmap
+// --in map.vxs --max-memory MiB runs slabs() over the whole map, slabs as
+// wide as the budget allows. Map rows go straight into out/map.bin, which
+// gzip then streams back from; the 3D mesh is copied out of the spill
+// file at the end.
+//
+// The budget covers the volumes; the 2D mesh and each slab's share of
+// the 3D mesh come on top, as does the whole map for brotli or zstd to
+// compress.
+int stream(const Args &args, const tune::profile &profile,
+		const std::set<std::string> &stages, bool raw, bool parallel,
+		std::string map_codec, int map_level, const std::function<void()> &open_outputs)
+{
+	reject(args, "--max-memory");
+
+	std::cout << "Mapping snapshot..." << std::flush;
+	Mapped in(args.get("--in", "maps/map.txt"));
 	std::cout << "Done." << std::endl;
+	std::cout << "Palette:" << std::endl;
+	print_palette();
 
-#endif
+	int width = slab_width((size_t)args.get("--max-memory", 0) << 20);
+	open_outputs();
 
-#ifdef VERTEX2D_BIN
+	bool with_map = stages.count("map"), with_vertex = stages.count("vertex");
+	int fd = -1;
+	if(with_map) {
+		fd = open("out/map.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0) throw std::runtime_error("cannot open out/map.bin");
+	}
 
-	std::cout << "Writing to 2D vertex file..." << std::flush;
+	Spill spill;
+	slabs(in, profile, 0, X, width, with_map, with_vertex,
+			[&](int x0, int x1, int y, int z, const Texels::value_type *texels) {
+				size_t row = (x1 - x0) * sizeof *texels;
+				size_t at = (((size_t)z * Y + y) * X + x0) * sizeof *texels;
+				if(pwrite(fd, texels, row, at) != (ssize_t)row)
+					throw std::runtime_error("cannot write out/map.bin");
+			},
+			spill);
+
+	if(with_map) {
+		std::cout << "Compressing map..." << std::flush;
+		close(fd);
+		codec::compress("out/map.bin", map_codec, map_level, parallel);
+		if(!raw) unlink("out/map.bin");
+		std::cout << "Done." << std::endl;
+	}
 
-	// 2d vertex mesh
-	for(int color = 0; color < pal_size; color++) {
-		
-		bool mask[X][Y];
-		forXY([&](int x, int y){
-			mask[x][y] = c2d[x][y] == color;
-		});
-		
-		forXY([&](int x, int y) {
-			int k = 0, l = 0, w = 0, h = 0;
+	if(with_vertex) {
+		std::vector<char> sky = skybox();
+		o_vertex.write(sky.data(), sky.size());
+		for(int color = 0; color < pal_size; color++)
+			spill.copy(color, [&](const char *data, size_t size) { o_vertex.write(data, size); });
+		o_vertex.close();
+	}
 
-			if(!mask[x][y]) return;
-			for(w = 1; x+w < X && mask[x+w][y]; w++) continue;
+	if(stages.count("vertex2d")) write_mesh2d(in, profile);
 
-			for(h = 1; y+h < Y; h++)
-			for(k = 0; k < w; k++)
-			{
-				if(!mask[x+k][y+h]) goto break2;
-			}
-			break2:
+	std::cout << "In all: " << memory::sample().str()
+		<< (memory::huge_pages() ? ", on huge pages" : ", on 4 KiB pages") << std::endl;
 
-			// glass material has id=2
-			int id = color == pal_size-1 ? 2 : 0;
-			quad2d(x, y, w, 0, 0, h, color, id);
+	std::cout << "^_^" << std::endl;
+
+	return 0;
+}
+
+// Builds split across processes, for maps one machine can't do alone:
+// bin/voxmap --in map.vxs --tiles N cuts the map into N x tiles of whole
+// chunks, runs a worker for each, and assembles the outputs from what
+// they leave in --tile-dir (out/tiles by default):
+//
+//   map.K.bin     the tile's texels, [z][y][x] like map.bin
+//   vertex.K.bin  the tile's 3D mesh color by color, after one uint64
+//                 byte count per color
+//
+// Each worker is bin/voxmap ... --tile K, run by the coordinator on this
+// machine; with --assemble the coordinator starts none and only collects
+// what workers elsewhere, given the same flags and a shared filesystem,
+// have written. Workers share nothing but files: each maps the snapshot
+// and reads only its own tile and halos from it, and recomputes the HALO
+// columns the SDF needs from the tile before it rather than waiting for
+// them. --max-memory bounds each worker as it does stream().
+struct Tiles {
+	int n, width;
+	std::string dir;
+
+	Tiles(const Args &args)
+		: n(args.get("--tiles", 1)), dir(args.get("--tile-dir", "out/tiles")) {
+		if(n < 1 || n > X / CHUNK)
+			throw std::runtime_error("--tiles: 1 to " + std::to_string(X / CHUNK) + " tiles");
+		width = (X / CHUNK + n - 1) / n * CHUNK;
+		n = (X + width - 1) / width;
+	}
+
+	int begin(int k) const { return k * width; }
+	int end(int k) const { return std::min(X, (k + 1) * width); }
+	std::string map(int k) const { return dir + "/map." + std::to_string(k) + ".bin"; }
+	std::string vertex(int k) const { return dir + "/vertex." + std::to_string(k) + ".bin"; }
+};
+
+// --tile K: one worker's artifacts
+int tile(const Args &args, const tune::profile &profile, const std::set<std::string> &stages)
+{
+	reject(args, "--tiles");
+	Tiles tiles(args);
+	int k = args.get("--tile", 0);
+	if(k < 0 || k >= tiles.n)
+		throw std::runtime_error("--tile: no tile " + std::to_string(k));
+	int begin = tiles.begin(k), end = tiles.end(k);
+
+	std::cout << "Tile " << k << ", columns " << begin << " to " << end << std::endl;
+	Mapped in(args.get("--in", "maps/map.txt"));
+	int width = args.has("--max-memory")
+		? slab_width((size_t)args.get("--max-memory", 0) << 20)
+		: end - begin;
+
+	bool with_map = stages.count("map"), with_vertex = stages.count("vertex");
+	int fd = -1;
+	if(with_map) {
+		fd = open(tiles.map(k).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0) throw std::runtime_error("cannot open " + tiles.map(k));
+	}
 
-			for (l = 0; l < h; l++)
-			for (k = 0; k < w; k++)
-			{
-				mask[x+k][y+l] = false;
+	Spill spill;
+	slabs(in, profile, begin, end, width, with_map, with_vertex,
+			[&](int x0, int x1, int y, int z, const Texels::value_type *texels) {
+				size_t row = (x1 - x0) * sizeof *texels;
+				size_t at = (((size_t)z * Y + y) * (end - begin) + x0 - begin) * sizeof *texels;
+				if(pwrite(fd, texels, row, at) != (ssize_t)row)
+					throw std::runtime_error("cannot write " + tiles.map(k));
+			},
+			spill);
+	if(with_map) close(fd);
+
+	if(with_vertex) {
+		std::ofstream out(tiles.vertex(k), std::ios::binary);
+		out.exceptions(std::fstream::badbit | std::fstream::failbit);
+		for(int color = 0; color < pal_size; color++) {
+			uint64_t size = spill.size(color);
+			out.write((const char *) &size, sizeof size);
+		}
+		for(int color = 0; color < pal_size; color++)
+			spill.copy(color, [&](const char *data, size_t size) { out.write(data, size); });
+	}
+
+	std::cout << "Tile " << k << " done" << std::endl;
+	return 0;
+}
+
+// --tiles N: the coordinator
+int tiles(const Args &args, const tune::profile &profile,
+		const std::set<std::string> &stages, bool raw, bool parallel,
+		std::string map_codec, int map_level, const std::function<void()> &open_outputs)
+{
+	reject(args, "--tiles");
+	Tiles tiles(args);
+	Mapped in(args.get("--in", "maps/map.txt"));
+	std::cout << "Palette:" << std::endl;
+	print_palette();
+
+	if(!args.has("--assemble")) {
+		mkdir(tiles.dir.c_str(), 0755);
+		std::cout << "Running " << tiles.n << " workers of " << tiles.width
+			<< " columns..." << std::endl;
+
+		// this binary again, with the same flags and a --tile each
+		std::vector<pid_t> workers;
+		for(int k = 0; k < tiles.n; k++) {
+			std::vector<std::string> argv = {"/proc/self/exe"};
+			argv.insert(argv.end(), args.argv.begin(), args.argv.end());
+			argv.push_back("--tile");
+			argv.push_back(std::to_string(k));
+			std::vector<char *> c_argv;
+			for(auto &arg : argv) c_argv.push_back(arg.data());
+			c_argv.push_back(nullptr);
+
+			pid_t pid;
+			if(posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, c_argv.data(), environ))
+				throw std::runtime_error("cannot start worker " + std::to_string(k));
+			workers.push_back(pid);
+		}
+		int failed = 0;
+		for(pid_t pid : workers) {
+			int status;
+			waitpid(pid, &status, 0);
+			if(!WIFEXITED(status) || WEXITSTATUS(status)) failed++;
+		}
+		if(failed)
+			throw std::runtime_error(std::to_string(failed) + " workers failed");
+	}
+
+	open_outputs();
+	std::cout << "Assembling..." << std::flush;
+	if(stages.count("map")) {
+		int fd = open("out/map.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0) throw std::runtime_error("cannot open out/map.bin");
+		// a z slice of a tile at a time, row by row into place
+		std::vector<Texels::value_type> slice;
+		for(int k = 0; k < tiles.n; k++) {
+			int begin = tiles.begin(k), w = tiles.end(k) - begin;
+			std::ifstream file(tiles.map(k), std::ios::binary);
+			if(!file) throw std::runtime_error("cannot open " + tiles.map(k));
+			file.exceptions(std::fstream::badbit | std::fstream::failbit);
+			slice.resize((size_t)w * Y);
+			for(int z = 0; z < Z; z++) {
+				file.read((char *) slice.data(), slice.size() * sizeof slice[0]);
+				for(int y = 0; y < Y; y++) {
+					size_t row = w * sizeof slice[0];
+					size_t at = (((size_t)z * Y + y) * X + begin) * sizeof slice[0];
+					if(pwrite(fd, &slice[(size_t)y * w], row, at) != (ssize_t)row)
+						throw std::runtime_error("cannot write out/map.bin");
+				}
 			}
-		});
+		}
+		close(fd);
+		codec::compress("out/map.bin", map_codec, map_level, parallel);
+		if(!raw) unlink("out/map.bin");
+	}
+
+	if(stages.count("vertex")) {
+		std::vector<char> sky = skybox();
+		o_vertex.write(sky.data(), sky.size());
+
+		// color by color, tile by tile
+		std::vector<std::ifstream> files(tiles.n);
+		std::vector<std::vector<uint64_t>> sizes(tiles.n, std::vector<uint64_t>(pal_size));
+		for(int k = 0; k < tiles.n; k++) {
+			files[k].open(tiles.vertex(k), std::ios::binary);
+			if(!files[k]) throw std::runtime_error("cannot open " + tiles.vertex(k));
+			files[k].exceptions(std::fstream::badbit | std::fstream::failbit);
+			files[k].read((char *) sizes[k].data(), pal_size * sizeof(uint64_t));
+		}
+		std::vector<char> piece;
+		for(int color = 0; color < pal_size; color++)
+		for(int k = 0; k < tiles.n; k++) {
+			piece.resize(sizes[k][color]);
+			files[k].read(piece.data(), piece.size());
+			o_vertex.write(piece.data(), piece.size());
+		}
+		o_vertex.close();
 	}
 
+	if(stages.count("vertex2d")) write_mesh2d(in, profile);
 	std::cout << "Done." << std::endl;
 
-#endif
+	std::cout << "^_^" << std::endl;
 
-#ifdef MAP_BIN
+	return 0;
+}
 
-	std::cout << "Generating summed volume table..." << std::flush;
+int run(int argc, char **argv)
+{
+	Args args(argc, argv);
+
+	// --raw also keeps the uncompressed .bin files next to the .bin.gz ones
+	int level = args.get("--level", Z_DEFAULT_COMPRESSION);
+	bool parallel = !args.has("--serial");
+	bool raw = args.has("--raw");
+
+	// --filter writes the map as out/map.planes (see filter.h) instead,
+	// delta-coded along --delta x, y or z, compressed with --codec:
+	// gzip, brotli or zstd at --map-level
+	bool planes = args.has("--filter");
+	std::string axis = args.get("--delta", "z");
+	if(axis != "x" && axis != "y" && axis != "z")
+		throw std::runtime_error("--delta: x, y or z, not \"" + axis + "\"");
+	int delta = axis[0] - 'x';
+	std::string map_codec = args.get("--codec", "gzip");
+	int map_level = args.get("--map-level", map_codec == "gzip" ? level : -1);
+
+	// --stages vertex,vertex2d,map (all by default) picks the outputs
+	std::set<std::string> stages;
+	{
+		std::istringstream list(args.get("--stages", "vertex,vertex2d,map"));
+		for(std::string stage; std::getline(list, stage, ',');) {
+			if(stage != "vertex" && stage != "vertex2d" && stage != "map")
+				throw std::runtime_error("--stages: vertex, vertex2d or map, not \"" + stage + "\"");
+			stages.insert(stage);
+		}
+	}
 
-	forXYZ([](int x, int y, int z) {
-		// compute a summed volume table
-		// aka: the number of blocks in the cube
-		// with diagonal (0,0,0)---(z,y,x), inclusive
-		sum[x][y][z] = bin[x][y][z]
+	// scheduling of each stage's parallel loops, see tune.h;
+	// --tune measures the best and saves it here
+	std::string profile_path = args.get("--profile", "bin/voxmap.tune");
+	tune::profile profile;
+	if(!args.has("--tune") && profile.load(profile_path))
+		std::cout << "Scheduling from " << profile_path << std::endl;
+
+	// a worker of a multi-process build, see tiles(), writes only its tile
+	if(args.has("--tile")) return tile(args, profile, stages);
+
+	// opened, so truncated, only once a path is sure to write them: after
+	// its flags and inputs are checked, and never by --tune
+	auto open_outputs = [&]() {
+		if(stages.count("vertex")) o_vertex.open("out/vertex.bin.gz", level, parallel, raw);
+		if(stages.count("vertex2d")) o_vertex2d.open("out/vertex2d.bin.gz", level, parallel, raw);
+	};
+
+	// --in is either a MagicaVoxel .vox, read directly, or Goxel's text
+	// export ("x y z RRGGBB" per line). Goxel centers the map on x, so text
+	// coordinates are shifted by 512 5 0; .vox ones so the map starts at 0.
+	// --offset "x y z" overrides either.
+	// --in map.vxs maps a snapshot saved by an earlier --save map.vxs
+	std::string path = args.get("--in", "maps/map.txt");
+	bool is_vox = path.ends_with(".vox");
+	bool is_snapshot = path.ends_with(".vxs");
+	std::unique_ptr<snapshot::mapping> mapped;
+	std::unique_ptr<Grid<int, 0>> rgb; // color before palettization
 
-			+ csum(  x,   y, z-1)
-			+ csum(  x, y-1,   z)
-			+ csum(x-1,   y,   z)
+	// so nothing fails silently
+	o_vertex.exceptions(std::fstream::badbit);
+	o_vertex2d.exceptions(std::fstream::badbit);
+
+	// --tiles N splits the build across processes, see tiles(); otherwise
+	// --max-memory MiB streams a snapshot through in slabs, see stream()
+	if(args.has("--tiles"))
+		return tiles(args, profile, stages, raw, parallel, map_codec, map_level, open_outputs);
+	if(args.has("--max-memory"))
+		return stream(args, profile, stages, raw, parallel, map_codec, map_level, open_outputs);
+
+	// --spans runs the stages on column spans (see spans.h), --sparse on
+	// a sparse tree (see sparse.h), instead of the dense volume: no summed
+	// volume table, and the 2D mesh comes from the tops of the columns.
+	// The dense volumes exist only as a mode reads them: --spans builds
+	// from col alone, and --sparse, unless it has to --save a snapshot,
+	// loads straight into its tree.
+	bool use_spans = args.has("--spans");
+	bool use_sparse = !use_spans && args.has("--sparse");
+	bool dense = !use_spans && !use_sparse;
+	bool save = args.has("--save") && !is_snapshot;
+
+	using Volume = Grid<uint8_t, 1, Layout>;
+	std::unique_ptr<Volume> col; // color, border clamped to the edges
+	std::unique_ptr<Volume> bin; // 1 if block, else 0
+	std::unique_ptr<Grid<int, 1, Layout>> sum; // summed volume table, border 0
+	std::unique_ptr<sparse::tree<int>> rgb_tree; // --sparse: color before palettization
+	Texels map(X, Y, Z);
+
+	Grid<int, 0> c2d(X, Y); // 2d color
+	Grid<int, 0> z2d(X, Y); // 2d z
+
+	auto remap = [&]() {
+		col->for_each([&](int x, int y, int z){
+			int i = 1;
+			for (; i < MAX && pal[i] != (*rgb)(x, y, z); i++) continue;
+			(*col)(x, y, z) = i;
+		});
+	};
+
+	if(is_snapshot) {
+		std::cout << "Mapping snapshot..." << std::flush;
+
+		mapped = std::make_unique<snapshot::mapping>(path);
+		const snapshot::header &h = *mapped->h;
+		if(h.dims[0] != X || h.dims[1] != Y || h.dims[2] != Z)
+			throw std::runtime_error(path + " has different map dimensions");
+		if(h.layout != Layout::id)
+			throw std::runtime_error(path + " was saved with another volume layout");
+
+		pal_size = h.pal_size;
+		std::copy(h.pal, h.pal + MAX, pal);
+
+		// the volumes are the mapped pages themselves
+		size_t bytes = Volume(X, Y, Z, nullptr).bytes();
+		col = std::make_unique<Volume>(X, Y, Z, mapped->get(snapshot::COL, bytes));
+		if(dense) bin = std::make_unique<Volume>(X, Y, Z, mapped->get(snapshot::BIN, bytes));
+		c2d.bind(mapped->get(snapshot::C2D, c2d.bytes()));
+		z2d.bind(mapped->get(snapshot::Z2D, z2d.bytes()));
+
+		std::cout << "Done." << std::endl;
+		std::cout << "Palette:" << std::endl;
+		print_palette();
+	} else {
+		std::cout << "Loading voxel map..." << std::flush;
 
-			- csum(x-1, y-1,   z)
-			- csum(x-1,   y, z-1)
-			- csum(  x, y-1, z-1)
+		if(use_sparse && !save) {
+			rgb_tree = std::make_unique<sparse::tree<int>>(X, Y, Z, 0);
+		} else {
+			rgb = std::make_unique<Grid<int, 0>>(X, Y, Z);
+			col = std::make_unique<Volume>(X, Y, Z);
+		}
+		if(dense || save) bin = std::make_unique<Volume>(X, Y, Z);
+
+		int offset[3] = {512, 5, 0};
+		auto put = [&](int x, int y, int z, int color) {
+			x += offset[0]; y += offset[1]; z += offset[2];
+			if(x < 0 || x >= X || y < 0 || y >= Y || z < 0 || z >= Z)
+				throw std::out_of_range(
+						"voxel (" + std::to_string(x) + ", " + std::to_string(y) + ", " +
+						std::to_string(z) + ") is outside the map; try --offset");
+
+			if(color == GLASS) color += 0x1000000;
+			pal_set.insert(color);
+
+			if(rgb_tree) rgb_tree->set(x, y, z, color);
+			else (*rgb)(x, y, z) = color;
+			if(bin) (*bin)(x, y, z) = 1;
+
+			if(z > z2d(x, y)) {
+				c2d(x, y) = color;
+				z2d(x, y) = z;
+			}
+		};
+
+		pal_set.insert(0);
+		if(is_vox) {
+			vox::scene scene(path);
+			auto min = scene.min();
+			for(int d = 0; d < 3; d++) offset[d] = -min[d];
+			std::istringstream(args.get("--offset", "")) >> offset[0] >> offset[1] >> offset[2];
+			scene.each(put);
+		} else {
+			std::ifstream in(path);
+			if(!in) throw std::runtime_error("cannot open " + path);
+			in.exceptions(std::fstream::badbit);
+			std::istringstream(args.get("--offset", "")) >> offset[0] >> offset[1] >> offset[2];
+
+			// Skip first 3 lines
+			for(int i = 0; i < 3; i++) in.ignore(256, '\n');
+
+			// Read input stream
+			for (
+					int x, y, z, color;
+					in >> std::dec >> x >> y >> z >> std::hex >> color;
+				 ) put(x, y, z, color);
+		}
 
-			+ csum(x-1, y-1, z-1);
-	});
+		std::cout << "Done." << std::endl;
 
-	std::cout << "Done." << std::endl;
+		std::cout << "Generating palette..." << std::endl;
 
-	std::cout << "Generating signed distance fields..." << std::flush;
+		for (int color : pal_set) pal[pal_size++] = color;
+		print_palette();
 
-	// find greatest allowable cube's radius as sdf
-	forXYZ([](int x, int y, int z) {
-		if(bin[x][y][z] > 0) return;
+		if(col) {
+			tune::run(profile["remap"], remap);
+			col->clamp_border();
+		}
 
-		// two octants: up and down
-		for(int o = 0; o < O; o++) {
-			// compute volume with summed volume table
+		parTiledXY<64, 64>(X, Y, [&](int x, int y){
+			int i = 1;
+			for (; i < MAX && pal[i] != c2d(x, y); i++) continue;
+			c2d(x, y) = i;
+		});
 
-			int min = 1;
-			int max = (o == 0) ? Z : z;
+		std::cout << "Done." << std::endl;
+
+		if(save) {
+			std::cout << "Saving snapshot..." << std::flush;
+			snapshot::header h = {};
+			h.dims[0] = X; h.dims[1] = Y; h.dims[2] = Z;
+			h.layout = Layout::id;
+			h.pal_size = pal_size;
+			std::copy(pal, pal + MAX, h.pal);
+			snapshot::save(args.get("--save", "maps/map.vxs"), h, {
+					{col->data(), col->bytes()},
+					{bin->data(), bin->bytes()},
+					{c2d.data(), c2d.bytes()},
+					{z2d.data(), z2d.bytes()},
+					});
+			std::cout << "Done." << std::endl;
+		}
+	}
 
-			// exploit fact that SDFs have a max gradient of 1
-			if(x+y+z > 0) {
-				int mid = csdf(x-1, y-1, z-1, o);
-				min = std::max(min, mid-1);
-				max = std::min(max, mid+1);
+	std::unique_ptr<spans::volume> columns;
+	std::unique_ptr<sparse::tree<uint8_t>> tree;
+	size_t dense_bytes = 2 * Volume(X, Y, Z, nullptr).bytes() +
+		Grid<int, 1, Layout>(X, Y, Z, nullptr).bytes();
+	if(use_spans) {
+		std::cout << "Building column spans..." << std::flush;
+		columns = std::make_unique<spans::volume>(*col, pal_size);
+		std::cout << "Done. " << columns->count() << " spans in "
+			<< (columns->bytes() >> 10) << " KiB, in place of "
+			<< (dense_bytes >> 10) << " KiB of dense volumes" << std::endl;
+	} else if(use_sparse) {
+		std::cout << "Building sparse tree..." << std::flush;
+		if(rgb_tree) {
+			// palettized leaf by leaf, as remap does the dense volume
+			tree = std::make_unique<sparse::tree<uint8_t>>(*rgb_tree, pal_size, [](int color) {
+				int i = 1;
+				for (; i < MAX && pal[i] != color; i++) continue;
+				return (uint8_t) i;
+			});
+			rgb_tree.reset();
+		} else {
+			tree = std::make_unique<sparse::tree<uint8_t>>(*col, pal_size);
+		}
+		std::cout << "Done. " << tree->count() << " leaves in "
+			<< (tree->bytes() >> 10) << " KiB, in place of "
+			<< (dense_bytes >> 10) << " KiB of dense volumes" << std::endl;
+	} else {
+		sum = std::make_unique<Grid<int, 1, Layout>>(X, Y, Z);
+	}
+	bool use_boxes = columns || tree; // volumes that answer empty(box) themselves
+
+	// call f with the volume the stages read
+	auto with_boxes = [&](auto f) {
+		if(columns) f(*columns);
+		else f(*tree);
+	};
+	auto with_volume = [&](auto f) {
+		if(use_boxes) with_boxes(f);
+		else f(*col);
+	};
+
+	// The parallel work of each stage, apart from writing its output so
+	// --tune can rerun it; each runs as its profile entry says.
+	std::vector<std::vector<char>> chunks(pal_size * N_chunks); // 3D mesh of each color's chunks
+	std::vector<std::vector<char>> colors(pal_size); // 2D mesh of each color
+	std::vector<std::pair<std::string, std::function<void()>>> kernels = {
+		{"distance", [&]() {
+			// straight into the texture, as are the colors
+			if(use_boxes) {
+				with_boxes([&](const auto &v) {
+					stages::distance(
+							[&](int x, int y, int z) { return v.solid(x, y, z); },
+							[&](int x0, int y0, int z0, int x1, int y1, int z1) {
+								return v.empty_box(x0, y0, z0, x1, y1, z1);
+							},
+							map);
+				});
+			} else {
+				stages::distance(*bin, stages::empty(*sum), map);
 			}
+			with_volume([&](const auto &volume) {
+				parFor(0, Z, [&](int z) {
+					for(int y = 0; y < Y; y++)
+					for(int x = 0; x < X; x++)
+						map(x, y, z)[2] = volume(x, y, z);
+				});
+			});
+		}},
+		{"mesh3d", [&]() {
+			// every chunk of every color at once, each into its own buffer
+			const int CY = Y / CHUNK, CZ = Z / CHUNK;
+			parFor(0, (int) chunks.size(), [&](int i) {
+				int color = i / N_chunks, c = i % N_chunks;
+				chunks[i].clear();
+				with_volume([&](const auto &volume) {
+					stages::chunk(volume, pal_size, color,
+							c / (CY * CZ) * CHUNK, c / CZ % CY * CHUNK, c % CZ * CHUNK,
+							[&](auto... args) { quad(chunks[i], args...); });
+				});
+			});
+		}},
+		{"mesh2d", [&]() {
+			// like c2d, which never records blocks at z = 0
+			auto top = [&](int x, int y) {
+				if(!use_boxes) return c2d(x, y);
+				int z, color;
+				with_boxes([&](const auto &v) { color = v.top(x, y, &z); });
+				return z > 0 ? color : pal_size;
+			};
+
+			// colors in parallel
+			parFor(0, pal_size, [&](int color) {
+				mesh2d(colors[color], color, top);
+			});
+		}},
+	};
+	if(sum) kernels.insert(kernels.begin(), {"summed", [&]() { stages::summed(*bin, *sum); }});
+	if(rgb) kernels.insert(kernels.begin(), {"remap", remap});
+
+	auto kernel = [&](std::string name) {
+		for(auto &[key, function] : kernels)
+			if(key == name) tune::run(profile[name], function);
+	};
+
+	if(args.has("--tune")) {
+		// thread counts from 1 up by doubling, and all of them
+		std::vector<int> threads;
+		int all = tbb::this_task_arena::max_concurrency();
+		for(int t = 1; t < all; t *= 2) threads.push_back(t);
+		threads.push_back(all);
+		int repeat = args.get("--tune-repeat", 1);
+
+		std::cout << "Tuning on " << all << " threads..." << std::endl;
+		for(auto &[name, function] : kernels) {
+			tune::config best;
+			double best_ms = 1e30;
+			for(int t : threads)
+			for(int p = 0; p < tune::PARTITIONERS; p++)
+			for(int grain : {1, 2, 4, 8, 16})
+			for(int i = 0; i < repeat; i++) {
+				tune::config c = {t, p, grain};
+				auto begin = std::chrono::steady_clock::now();
+				tune::run(c, function);
+				std::chrono::duration<double, std::milli> ms =
+						std::chrono::steady_clock::now() - begin;
+				if(ms.count() < best_ms) {
+					best_ms = ms.count();
+					best = c;
+				}
+			}
+			profile.set(name, best);
+			std::cout << "  " << name << ": " << best.threads << " threads, "
+				<< tune::NAMES[best.partitioner] << " partitioner, grain "
+				<< best.grain << ", " << best_ms << " ms" << std::endl;
+		}
 
-			int r = min;
-			while(
-					(r < max) &&
-					(0 == vol(
-								 x-r,y-r,z-(o)*r,
-								 x+r,y+r,z+(1-o)*r
-								))
-				  ) r++;
+		profile.save(profile_path);
+		std::cout << "Saved " << profile_path << std::endl;
+		return 0;
+	}
+	rgb.reset();
+	open_outputs();
+
+	// Everything after loading is a dependency graph: the 3D mesh, the 2D
+	// mesh and the SAT -> SDF -> map chain only read the volume, so they
+	// run concurrently, and each file is compressed while the others compute.
+	// --stages picks the outputs: any of vertex, vertex2d and map.
+	tbb::flow::graph graph;
+	tbb::flow::broadcast_node<tbb::flow::continue_msg> start(graph);
+
+	auto stage = [&](std::string name, auto function) {
+		return tbb::flow::continue_node<tbb::flow::continue_msg>(graph, [=](auto) {
+			auto begin = std::chrono::steady_clock::now();
+			auto before = memory::sample();
+			function();
+			auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+					std::chrono::steady_clock::now() - begin).count();
+			// process-wide counts, so they include whatever ran alongside
+			std::cout << "  " + name + ": done in " + std::to_string(ms) + " ms, " +
+				(memory::sample() - before).str() + "\n" << std::flush;
+		});
+	};
 
-			sdf[x][y][z][o] = r;
-		}
+	auto mesh3d = stage("3D vertex file", [&]() {
+		// Draw skybox
+		std::vector<char> sky = skybox();
+		o_vertex.write(sky.data(), sky.size());
+
+		// 3d vertex mesh, written color by color, chunk by chunk
+		kernel("mesh3d");
+		for(auto &chunk : chunks) o_vertex.write(chunk.data(), chunk.size());
+
+		o_vertex.close();
 	});
 
-	std::cout << "Done." << std::endl;
-	std::cout << "Writing to SDF file..." << std::flush;
+	auto mesh2d = stage("2D vertex file", [&]() {
+		// 2d vertex mesh, written color by color
+		kernel("mesh2d");
+		for(auto &color : colors) o_vertex2d.write(color.data(), color.size());
 
-	forZYX([](int x, int y, int z) {
-		int _x = x;
-		int _y = Y*z + y;
+		o_vertex2d.close();
+	});
 
-		o_map.put((char) sdf[x][y][z][0]);
-		o_map.put((char) sdf[x][y][z][1]);
-		o_map.put((char) col[x][y][z]);
-		o_map.put((char) 0);
+	auto summed = stage("summed volume table", [&]() {
+		kernel("summed");
 	});
 
-	o_map.close();
+	auto distance = stage("signed distance fields", [&]() {
+		kernel("distance");
+	});
 
-	std::cout << "Done." << std::endl;
-	std::cout << "^_^" << std::endl;
+	auto write_map = stage("SDF file", [&]() {
+		const char *texels = (const char *) map.data();
 
-#endif
+		if(raw) {
+			std::ofstream o_raw("out/map.bin", std::ios::binary);
+			o_raw.exceptions(std::fstream::badbit);
+			o_raw.write(texels, map.bytes());
+		}
+
+		if(planes)
+			codec::write("out/map.planes", filter::encode(texels, map.bytes(), X, Y, Z, delta), map_codec, map_level, parallel);
+		else
+			codec::write("out/map.bin", texels, map.bytes(), map_codec, map_level, parallel);
+	});
+
+	if(stages.count("vertex")) tbb::flow::make_edge(start, mesh3d);
+	if(stages.count("vertex2d")) tbb::flow::make_edge(start, mesh2d);
+	if(stages.count("map")) {
+		if(use_boxes) {
+			tbb::flow::make_edge(start, distance);
+		} else {
+			tbb::flow::make_edge(start, summed);
+			tbb::flow::make_edge(summed, distance);
+		}
+		tbb::flow::make_edge(distance, write_map);
+	}
+
+	std::cout << "Running stages..." << std::endl;
+	start.try_put(tbb::flow::continue_msg());
+	graph.wait_for_all();
+
+	std::cout << "In all: " << memory::sample().str()
+		<< (memory::huge_pages() ? ", on huge pages" : ", on 4 KiB pages") << std::endl;
+
+	std::cout << "^_^" << std::endl;
 
 	return 0;
 }
+
+// errors end the run with their message and status 1, workers included
+int main(int argc, char **argv)
+{
+	try {
+		return run(argc, argv);
+	} catch(const std::exception &e) {
+		std::cerr << "voxmap: " << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Binary snapshot of the loaded and palettized volume.
+//
+// A page-sized header, then each section starting on its own page, stored
+// exactly as the generator keeps it in memory. Opening a snapshot maps the
+// file and points the volumes at it: no parsing, and pages are only read
+// when a stage touches them. Bump VERSION whenever a section changes.
+
+namespace snapshot {
+
+const char MAGIC[4] = {'V', 'X', 'S', 'N'};
+const uint32_t VERSION = 3;
+const size_t PAGE = 4096;
+const int MAX_SECTIONS = 8;
+
+struct header {
+  char magic[4];
+  uint32_t version;
+  uint32_t dims[3];
+  uint32_t layout; // Linear or Brick<B>::id, see voxmap.h
+  uint32_t pal_size;
+  int32_t pal[256];
+  uint32_t sections;
+  uint64_t offset[MAX_SECTIONS];
+  uint64_t size[MAX_SECTIONS];
+};
+static_assert(sizeof(header) <= PAGE);
+
+// sections bin/voxmap saves, in file order
+enum { COL, BIN, C2D, Z2D };
+
+struct section {
+  const void *data;
+  size_t size;
+};
+
+inline size_t page_align(size_t n) { return (n + PAGE - 1) / PAGE * PAGE; }
+
+inline void save(std::string path, header h, std::vector<section> sections) {
+  if (sections.size() > MAX_SECTIONS)
+    throw std::runtime_error("snapshot: too many sections");
+  memcpy(h.magic, MAGIC, 4);
+  h.version = VERSION;
+  h.sections = sections.size();
+
+  size_t at = PAGE;
+  for (size_t i = 0; i < sections.size(); i++) {
+    h.offset[i] = at;
+    h.size[i] = sections[i].size;
+    at = page_align(at + sections[i].size);
+  }
+
+  std::ofstream out(path, std::ios::binary);
+  out.exceptions(std::fstream::badbit | std::fstream::failbit);
+  std::vector<char> pad(PAGE);
+  out.write((const char *)&h, sizeof h);
+  out.write(pad.data(), PAGE - sizeof h);
+  for (size_t i = 0; i < sections.size(); i++) {
+    out.write((const char *)sections[i].data, sections[i].size);
+    out.write(pad.data(), page_align(sections[i].size) - sections[i].size);
+  }
+}
+
+// a read-only view of a snapshot file; copy-on-write if a stage writes
+class mapping {
+  char *base = nullptr;
+  size_t length = 0;
+
+public:
+  const header *h = nullptr;
+
+  explicit mapping(std::string path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("snapshot: cannot open " + path);
+    struct stat st;
+    fstat(fd, &st);
+    length = st.st_size;
+    if (length < PAGE) {
+      close(fd);
+      throw std::runtime_error("snapshot: truncated " + path);
+    }
+    void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) throw std::runtime_error("snapshot: cannot map " + path);
+    base = (char *)p;
+    h = (const header *)base;
+
+    if (memcmp(h->magic, MAGIC, 4))
+      throw std::runtime_error("snapshot: " + path + " is not a snapshot");
+    if (h->version != VERSION)
+      throw std::runtime_error("snapshot: " + path + " is version " +
+                               std::to_string(h->version) + ", expected " +
+                               std::to_string(VERSION));
+    if (h->sections > MAX_SECTIONS)
+      throw std::runtime_error("snapshot: " + path + " has " +
+                               std::to_string(h->sections) + " sections");
+    for (uint32_t i = 0; i < h->sections; i++)
+      if (h->offset[i] > length || h->size[i] > length - h->offset[i])
+        throw std::runtime_error("snapshot: truncated " + path);
+  }
+  mapping(const mapping &) = delete;
+  ~mapping() {
+    if (base) munmap(base, length);
+  }
+
+  // drop the pages wholly inside [p, p + n) until they are read again,
+  // for callers streaming through a section
+  void release(const void *p, size_t n) const {
+    uintptr_t begin = ((uintptr_t)p + PAGE - 1) / PAGE * PAGE;
+    uintptr_t end = ((uintptr_t)p + n) / PAGE * PAGE;
+    if (begin < end) madvise((void *)begin, end - begin, MADV_DONTNEED);
+  }
+
+  // section i, checked against the size the caller expects
+  void *get(uint32_t i, size_t size) const {
+    if (i >= h->sections || h->size[i] != size)
+      throw std::runtime_error("snapshot: section " + std::to_string(i) +
+                               " does not match this build");
+    return base + h->offset[i];
+  }
+};
+
+} // namespace snapshot
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "voxmap.h"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+// Column run-length volume.
+//
+// The campus is mostly vertical columns: ground, walls, roofs. Here each
+// (x, y) column is a short list of spans [z0, z1) of one material, sorted
+// by z, and every cell outside a span is `empty`. Memory grows with the
+// number of spans, i.e. with the surface, rather than with the height.
+//
+// A volume reads like a Grid, so the stages run on it unchanged:
+// (x, y, z) is the material there, clamped to the map like col's border.
+// On top of that it answers the two questions the stages really ask of
+// a dense volume: whether a box is empty (no summed volume table needed)
+// and what is on top of a column.
+//
+// Box queries go through a 2D sparse table of 64-bit z masks: level k
+// holds, for each 2^k square of columns, which of 64 z bins hold a block.
+// Any rectangle is covered by a few overlapping squares of one level, so
+// "empty" is a handful of ORs; only when a map is taller than 64 and a
+// bin is partly in the box are the spans themselves scanned. The table
+// costs 8 bytes per column per level, log2(2 nz) levels: area, not volume.
+
+namespace spans {
+
+struct span {
+  uint16_t z0, z1; // [z0, z1)
+  uint8_t material;
+};
+
+class volume {
+  std::vector<uint32_t> first; // column c's spans are first[c]..first[c+1]
+  std::vector<span> runs;
+  int bin_z; // z per mask bit
+  std::vector<std::vector<uint64_t>> masks; // [level][column]
+
+  int column(int x, int y) const { return x * ny + y; }
+
+  uint64_t bits(int z0, int z1) const { // bins of [z0, z1], inclusive
+    int b0 = z0 / bin_z, b1 = z1 / bin_z;
+    return (b1 == 63 ? ~0ull : (2ull << b1) - 1) & ~((1ull << b0) - 1);
+  }
+
+  bool scan(int x0, int y0, int z0, int x1, int y1, int z1) const {
+    for (int x = x0; x <= x1; x++)
+    for (int y = y0; y <= y1; y++)
+      for (const span *s = begin(x, y); s != end(x, y) && s->z0 <= z1; s++)
+        if (s->z1 > z0) return false;
+    return true;
+  }
+
+public:
+  const int nx, ny, nz;
+  const uint8_t empty;
+
+  // the spans of a dense grid of materials, columns in parallel
+  volume(const auto &dense, uint8_t empty)
+      : nx(dense.nx), ny(dense.ny), nz(dense.nz), empty(empty) {
+    int columns = nx * ny;
+    std::vector<std::vector<span>> local(columns);
+    parFor(0, columns, [&](int c) {
+      int x = c / ny, y = c % ny;
+      for (int z = 0; z < nz;) {
+        uint8_t m = dense(x, y, z);
+        int z0 = z;
+        while (z < nz && dense(x, y, z) == m) z++;
+        if (m != empty) local[c].push_back({(uint16_t)z0, (uint16_t)z, m});
+      }
+    });
+
+    first.resize(columns + 1);
+    for (int c = 0; c < columns; c++)
+      first[c + 1] = first[c] + local[c].size();
+    runs.resize(first[columns]);
+    parFor(0, columns, [&](int c) {
+      std::copy(local[c].begin(), local[c].end(), runs.begin() + first[c]);
+    });
+
+    bin_z = (nz + 63) / 64;
+    masks.emplace_back(columns);
+    parFor(0, columns, [&](int c) {
+      for (const span &s : local[c]) masks[0][c] |= bits(s.z0, s.z1 - 1);
+    });
+    // the cubes distance() grows are at most 2 nz + 1 across
+    for (int k = 1; 1 << k <= std::min({nx, ny, 2 * nz + 1}); k++) {
+      const std::vector<uint64_t> &below = masks[k - 1];
+      std::vector<uint64_t> level(columns);
+      int h = 1 << (k - 1);
+      parFor(0, nx - 2 * h + 1, [&](int x) {
+        for (int y = 0; y + 2 * h <= ny; y++)
+          level[column(x, y)] = below[column(x, y)] | below[column(x + h, y)] |
+                                below[column(x, y + h)] |
+                                below[column(x + h, y + h)];
+      });
+      masks.push_back(std::move(level));
+    }
+  }
+
+  size_t count() const { return runs.size(); }
+  size_t bytes() const {
+    return first.size() * sizeof first[0] + runs.size() * sizeof runs[0] +
+           masks.size() * nx * ny * sizeof(uint64_t);
+  }
+
+  const span *begin(int x, int y) const { return &runs[first[column(x, y)]]; }
+  const span *end(int x, int y) const { return &runs[first[column(x, y) + 1]]; }
+
+  uint8_t operator()(int x, int y, int z) const {
+    x = std::clamp(x, 0, nx - 1);
+    y = std::clamp(y, 0, ny - 1);
+    z = std::clamp(z, 0, nz - 1);
+    for (const span *s = begin(x, y); s != end(x, y) && s->z0 <= z; s++)
+      if (z < s->z1) return s->material;
+    return empty;
+  }
+  bool solid(int x, int y, int z) const { return (*this)(x, y, z) != empty; }
+
+  // whether the box, inclusive and clipped to the map, holds no blocks
+  bool empty_box(int x0, int y0, int z0, int x1, int y1, int z1) const {
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    z0 = std::max(z0, 0);
+    x1 = std::min(x1, nx - 1);
+    y1 = std::min(y1, ny - 1);
+    z1 = std::min(z1, nz - 1);
+    if (x0 > x1 || y0 > y1 || z0 > z1) return true;
+
+    int k = std::bit_width((unsigned)std::min(x1 - x0, y1 - y0) + 1) - 1;
+    k = std::min(k, (int)masks.size() - 1);
+    int s = 1 << k;
+    uint64_t hit = 0;
+    for (int x = x0;; x = std::min(x + s, x1 - s + 1)) {
+      for (int y = y0;; y = std::min(y + s, y1 - s + 1)) {
+        hit |= masks[k][column(x, y)];
+        if (y + s > y1) break;
+      }
+      if (x + s > x1) break;
+    }
+    hit &= bits(z0, z1);
+    if (!hit) return true;
+    if (bin_z == 1) return false;
+    return scan(x0, y0, z0, x1, y1, z1);
+  }
+
+  // material of the highest block in the column, and its z (-1 if none)
+  uint8_t top(int x, int y, int *z = nullptr) const {
+    const span *b = begin(x, y), *e = end(x, y);
+    if (z) *z = b == e ? -1 : e[-1].z1 - 1;
+    return b == e ? empty : e[-1].material;
+  }
+};
+
+} // namespace spans
@@ -0,0 +1,252 @@
+#pragma once
+
+#include "voxmap.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Sparse hierarchical volume, after OpenVDB.
+//
+//   root      hash map of internal nodes, so the map has no fixed size
+//   internal  16^3 leaves, 128^3 cells, allocated as blocks appear
+//   leaf      8^3 cells plus an occupancy mask, one bit per block
+//
+// Only leaves holding blocks exist, so memory follows the occupied
+// surface. Reads outside any leaf return the background.
+//
+// A tree reads like a Grid: (x, y, z) is the material there, clamped to
+// [0, nx) etc. like col's border, so the stages run on it unchanged. It
+// also answers empty(box) from the occupancy masks, with no summed
+// volume table, and the top of a column.
+
+namespace sparse {
+
+const int LEAF = 8; // cells per leaf side
+const int NODE = 16; // leaves per internal node side
+const int SPAN = LEAF * NODE; // cells per internal node side
+
+template <typename T>
+struct leaf {
+  int origin[3];
+  T values[LEAF * LEAF * LEAF]; // [x][y][z]
+  // mask[x] bit y * 8 + z is set for blocks; a whole x slice per word
+  uint64_t mask[LEAF] = {};
+
+  static int index(int x, int y, int z) { return (x * LEAF + y) * LEAF + z; }
+};
+
+template <typename T>
+struct internal {
+  std::array<std::unique_ptr<leaf<T>>, NODE * NODE * NODE> children;
+
+  static int index(int x, int y, int z) { return (x * NODE + y) * NODE + z; }
+};
+
+// floor division for coordinates that may be negative
+inline int down(int v, int n) { return v >= 0 ? v / n : -((-v + n - 1) / n); }
+
+// bits y * 8 + z of a leaf x slice for y in [y0, y1], z in [z0, z1]
+inline uint64_t slice_bits(int y0, int y1, int z0, int z1) {
+  uint64_t row = ((2u << z1) - 1) & ~((1u << z0) - 1);
+  uint64_t bits = 0;
+  for (int y = y0; y <= y1; y++) bits |= row << (y * LEAF);
+  return bits;
+}
+
+template <typename T>
+class tree {
+  std::unordered_map<uint64_t, std::unique_ptr<internal<T>>> root;
+  std::vector<leaf<T> *> leaves;
+
+  static uint64_t key(int ix, int iy, int iz) {
+    return (uint64_t)(uint32_t)(ix + (1 << 20)) << 42 |
+           (uint64_t)(uint32_t)(iy + (1 << 20)) << 21 |
+           (uint64_t)(uint32_t)(iz + (1 << 20));
+  }
+
+  // stages read neighboring cells, so each thread remembers the last
+  // internal node it found, as VDB's value accessors do. A miss is
+  // remembered too, until set() adds a node and bumps the generation.
+  const uint64_t id = next_id();
+  uint64_t generation = 0;
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> ids = 1;
+    return ids++;
+  }
+  struct cache {
+    uint64_t tree = 0, generation = 0, key = 0;
+    const internal<T> *node = nullptr;
+  };
+
+  const internal<T> *node(int ix, int iy, int iz) const {
+    static thread_local cache last;
+    uint64_t k = key(ix, iy, iz);
+    if (last.tree == id && last.generation == generation && last.key == k)
+      return last.node;
+    auto it = root.find(k);
+    last = {id, generation, k, it == root.end() ? nullptr : it->second.get()};
+    return last.node;
+  }
+
+public:
+  const int nx, ny, nz;
+  const T background;
+
+  tree(int nx, int ny, int nz, T background)
+      : nx(nx), ny(ny), nz(nz), background(background) {}
+
+  // the blocks of a dense grid of materials: everything but background.
+  // Slabs one internal node wide in x share no nodes, so each is built
+  // as a tree of its own, in parallel, and their nodes moved in after,
+  // leaves in the order a single pass over x, y and z would make them.
+  tree(const auto &dense, T background)
+      : tree(dense.nx, dense.ny, dense.nz, background) {
+    std::vector<std::unique_ptr<tree>> slabs(down(nx - 1, SPAN) + 1);
+    parFor(0, (int)slabs.size(), [&](int i) {
+      slabs[i] = std::make_unique<tree>(nx, ny, nz, background);
+      for (int x = i * SPAN; x < std::min(nx, i * SPAN + SPAN); x++)
+      for (int y = 0; y < ny; y++)
+      for (int z = 0; z < nz; z++)
+        if (dense(x, y, z) != background) slabs[i]->set(x, y, z, dense(x, y, z));
+    });
+    for (auto &slab : slabs) {
+      for (auto &[k, n] : slab->root) root[k] = std::move(n);
+      leaves.insert(leaves.end(), slab->leaves.begin(), slab->leaves.end());
+    }
+    generation++;
+  }
+
+  // another tree's blocks, each material converted by f, e.g. colors
+  // to palette indices
+  template <typename U>
+  tree(const tree<U> &other, T background, auto f)
+      : tree(other.nx, other.ny, other.nz, background) {
+    other.each([&](int x, int y, int z, U v) { set(x, y, z, f(v)); });
+  }
+
+  const leaf<T> *find(int x, int y, int z) const {
+    int lx = down(x, LEAF), ly = down(y, LEAF), lz = down(z, LEAF);
+    const internal<T> *n = node(down(lx, NODE), down(ly, NODE), down(lz, NODE));
+    if (!n) return nullptr;
+    return n->children[internal<T>::index(lx - down(lx, NODE) * NODE,
+                                          ly - down(ly, NODE) * NODE,
+                                          lz - down(lz, NODE) * NODE)]
+        .get();
+  }
+
+  // not thread-safe: builds run on one thread, stages only read
+  void set(int x, int y, int z, T v) {
+    int lx = down(x, LEAF), ly = down(y, LEAF), lz = down(z, LEAF);
+    int ix = down(lx, NODE), iy = down(ly, NODE), iz = down(lz, NODE);
+    auto &n = root[key(ix, iy, iz)];
+    if (!n) {
+      n = std::make_unique<internal<T>>();
+      generation++;
+    }
+    auto &l = n->children[internal<T>::index(lx - ix * NODE, ly - iy * NODE,
+                                             lz - iz * NODE)];
+    if (!l) {
+      l = std::make_unique<leaf<T>>();
+      l->origin[0] = lx * LEAF;
+      l->origin[1] = ly * LEAF;
+      l->origin[2] = lz * LEAF;
+      std::fill(std::begin(l->values), std::end(l->values), background);
+      leaves.push_back(l.get());
+    }
+    x -= l->origin[0];
+    y -= l->origin[1];
+    z -= l->origin[2];
+    l->values[leaf<T>::index(x, y, z)] = v;
+    uint64_t bit = 1ull << (y * LEAF + z);
+    if (v != background) l->mask[x] |= bit;
+    else l->mask[x] &= ~bit;
+  }
+
+  T operator()(int x, int y, int z) const {
+    x = std::clamp(x, 0, nx - 1);
+    y = std::clamp(y, 0, ny - 1);
+    z = std::clamp(z, 0, nz - 1);
+    const leaf<T> *l = find(x, y, z);
+    if (!l) return background;
+    return l->values[leaf<T>::index(x - l->origin[0], y - l->origin[1],
+                                    z - l->origin[2])];
+  }
+  bool solid(int x, int y, int z) const { return (*this)(x, y, z) != background; }
+
+  // whether the box, inclusive and clipped to the map, holds no blocks
+  bool empty_box(int x0, int y0, int z0, int x1, int y1, int z1) const {
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    z0 = std::max(z0, 0);
+    x1 = std::min(x1, nx - 1);
+    y1 = std::min(y1, ny - 1);
+    z1 = std::min(z1, nz - 1);
+
+    // internal nodes first, then their leaves, then masks a slice at a time
+    for (int ix = down(x0, SPAN); ix <= down(x1, SPAN); ix++)
+    for (int iy = down(y0, SPAN); iy <= down(y1, SPAN); iy++)
+    for (int iz = down(z0, SPAN); iz <= down(z1, SPAN); iz++) {
+      const internal<T> *n = node(ix, iy, iz);
+      if (!n) continue;
+      int bx0 = std::max(x0, ix * SPAN), bx1 = std::min(x1, ix * SPAN + SPAN - 1);
+      int by0 = std::max(y0, iy * SPAN), by1 = std::min(y1, iy * SPAN + SPAN - 1);
+      int bz0 = std::max(z0, iz * SPAN), bz1 = std::min(z1, iz * SPAN + SPAN - 1);
+
+      for (int lx = bx0 / LEAF; lx <= bx1 / LEAF; lx++)
+      for (int ly = by0 / LEAF; ly <= by1 / LEAF; ly++)
+      for (int lz = bz0 / LEAF; lz <= bz1 / LEAF; lz++) {
+        const leaf<T> *l = n->children[internal<T>::index(
+            lx - ix * NODE, ly - iy * NODE, lz - iz * NODE)].get();
+        if (!l) continue;
+        int cx0 = std::max(bx0 - lx * LEAF, 0), cx1 = std::min(bx1 - lx * LEAF, LEAF - 1);
+        int cy0 = std::max(by0 - ly * LEAF, 0), cy1 = std::min(by1 - ly * LEAF, LEAF - 1);
+        int cz0 = std::max(bz0 - lz * LEAF, 0), cz1 = std::min(bz1 - lz * LEAF, LEAF - 1);
+        uint64_t bits = cy0 == 0 && cy1 == LEAF - 1 && cz0 == 0 && cz1 == LEAF - 1
+                            ? ~0ull
+                            : slice_bits(cy0, cy1, cz0, cz1);
+        for (int x = cx0; x <= cx1; x++)
+          if (l->mask[x] & bits) return false;
+      }
+    }
+    return true;
+  }
+
+  // material of the highest block in the column, and its z (-1 if none)
+  T top(int x, int y, int *z = nullptr) const {
+    for (int lz = down(nz - 1, LEAF); lz >= 0; lz--) {
+      const leaf<T> *l = find(x, y, lz * LEAF);
+      if (!l) continue;
+      int cx = x - l->origin[0], cy = y - l->origin[1];
+      uint64_t row = l->mask[cx] >> (cy * LEAF) & 0xFF;
+      if (!row) continue;
+      int cz = std::bit_width(row) - 1;
+      if (z) *z = l->origin[2] + cz;
+      return l->values[leaf<T>::index(cx, cy, cz)];
+    }
+    if (z) *z = -1;
+    return background;
+  }
+
+  // function(x, y, z, material) for every block, one leaf after another
+  void each(auto function) const {
+    for (const leaf<T> *l : leaves)
+      for (int x = 0; x < LEAF; x++)
+        for (uint64_t bits = l->mask[x]; bits; bits &= bits - 1) {
+          int i = std::countr_zero(bits), y = i / LEAF, z = i % LEAF;
+          function(l->origin[0] + x, l->origin[1] + y, l->origin[2] + z,
+                   l->values[leaf<T>::index(x, y, z)]);
+        }
+  }
+
+  size_t count() const { return leaves.size(); }
+  size_t bytes() const {
+    return root.size() * sizeof(internal<T>) + leaves.size() * sizeof(leaf<T>);
+  }
+};
+
+} // namespace sparse
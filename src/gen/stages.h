@@ -0,0 +1,226 @@
+#pragma once
+
+#include "voxmap.h"
+#include <algorithm>
+
+// The volume stages of bin/voxmap, written against Grid's accessors only,
+// so they run unchanged on any storage layout (see bin/bench).
+
+namespace stages {
+
+const int O = 2; // Two octants, down(0) and up(1)
+
+// number of blocks in the box, inclusive: the box is clipped to the map,
+// and sum's zero border stands in for x0 - 1 = -1
+inline int volume(const auto &sum, int x0, int y0, int z0, int x1, int y1,
+                  int z1) {
+  x0 = std::max(x0, 0) - 1;
+  y0 = std::max(y0, 0) - 1;
+  z0 = std::max(z0, 0) - 1;
+  x1 = std::min(x1, sum.nx - 1);
+  y1 = std::min(y1, sum.ny - 1);
+  z1 = std::min(z1, sum.nz - 1);
+  return 0
+    - sum(x1, y1, z0)
+    - sum(x1, y0, z1)
+    - sum(x0, y1, z1)
+
+    + sum(x1, y1, z1)
+
+    + sum(x0, y0, z1)
+    + sum(x0, y1, z0)
+    + sum(x1, y0, z0)
+
+    - sum(x0, y0, z0);
+}
+
+// empty(box) for distance(), from a summed volume table
+inline auto empty(const auto &sum) {
+  return [&sum](int x0, int y0, int z0, int x1, int y1, int z1) {
+    return volume(sum, x0, y0, z0, x1, y1, z1) == 0;
+  };
+}
+
+// compute a summed volume table
+// aka: the number of blocks in the cube
+// with diagonal (0,0,0)---(z,y,x), inclusive
+// sum's zero border stands in for -1
+//
+// A 3D prefix sum is three 1D ones: along z, then y, then x. Each pass
+// runs its lines in parallel, a tile of them at a time.
+inline void summed(const auto &bin, const auto &sum) {
+  int nx = sum.nx, ny = sum.ny, nz = sum.nz;
+  parTiledXY<16, 16>(nx, ny, [&](int x, int y) {
+    int s = 0;
+    for (int z = 0; z < nz; z++) sum(x, y, z) = s += bin(x, y, z);
+  });
+  parTiles<8, 1, 32>(nx, 1, nz,
+      [&](int x0, int, int z0, int x1, int, int z1) {
+        for (int x = x0; x < x1; x++)
+        for (int y = 1; y < ny; y++)
+        for (int z = z0; z < z1; z++)
+          sum(x, y, z) += sum(x, y-1, z);
+      });
+  parTiles<1, 8, 32>(1, ny, nz,
+      [&](int, int y0, int z0, int, int y1, int z1) {
+        for (int x = 1; x < nx; x++)
+        for (int y = y0; y < y1; y++)
+        for (int z = z0; z < z1; z++)
+          sum(x, y, z) += sum(x-1, y, z);
+      });
+}
+
+// find greatest allowable cube's radius as sdf, for one cell:
+// solid(x, y, z) is true for blocks, and empty(x0, y0, z0, x1, y1, z1)
+// for boxes (inclusive, clipped to the map) without any
+//
+// Both keep what the original clamped accessors did: the diagonal
+// neighbor is clamped to the map, and boxes start at 1, not 0, since the
+// clamped summed volume table held only the block itself on the x, y and
+// z = 0 faces, so blocks there never counted.
+inline void distance(const auto &solid, const auto &empty, const auto &sdf,
+                     int x, int y, int z) {
+  if (solid(x, y, z)) return;
+
+  // two octants: up and down
+  for (int o = 0; o < O; o++) {
+    // grow the cube while it stays empty
+
+    int min = 1;
+    int max = (o == 0) ? sdf.nz : z;
+
+    // exploit fact that SDFs have a max gradient of 1
+    if (x + y + z > 0) {
+      int mid = sdf(std::max(x-1, 0), std::max(y-1, 0), std::max(z-1, 0))[o];
+      min = std::max(min, mid-1);
+      max = std::min(max, mid+1);
+    }
+
+    int r = min;
+    while (
+        (r < max) &&
+        empty(
+              std::max(x-r, 1), std::max(y-r, 1), std::max(z-(o)*r, 1),
+              x+r, y+r, z+(1-o)*r
+             )
+        ) r++;
+
+    sdf(x, y, z)[o] = r;
+  }
+}
+
+// The bound above reads the cell at (x-1, y-1, z-1), so a column of T*T
+// cells needs the columns at x-T and y-T done first: columns run in
+// parallel by wavefront, one anti-diagonal of them after another, each
+// still visited z fastest.
+//
+// Only the columns x in [begin, end) are computed, so a map can be done
+// in x slabs, left to right; column begin - 1 must be done already.
+const int SDF_TILE = 32;
+
+inline void distance(const auto &solid, const auto &empty, const auto &sdf,
+                     int begin, int end) {
+  const int T = SDF_TILE;
+  int tx = (end - begin + T - 1) / T, ty = (sdf.ny + T - 1) / T;
+  for (int d = 0; d < tx + ty - 1; d++)
+  parFor(std::max(0, d - ty + 1), std::min(d, tx - 1) + 1, [&](int i) {
+    int x0 = begin + i * T, y0 = (d - i) * T;
+    for (int x = x0; x < std::min(x0 + T, end); x++)
+    for (int y = y0; y < std::min(y0 + T, sdf.ny); y++)
+    for (int z = 0; z < sdf.nz; z++)
+      distance(solid, empty, sdf, x, y, z);
+  });
+}
+
+inline void distance(const auto &solid, const auto &empty, const auto &sdf) {
+  distance(solid, empty, sdf, 0, sdf.nx);
+}
+
+// https://gist.github.com/Vercidium/a3002bd083cce2bc854c9ff8f0118d33
+// greedy 3d mesh of one color's faces in the chunk at (cx, cy, cz):
+// calls quad(x, y, z, du..., dv..., color, normal, id) for each rectangle.
+// Chunks only read col, so any number of them can be meshed at once.
+inline void chunk(const auto &col, int pal_size, int color, int cx, int cy,
+                  int cz, auto quad) {
+  for (int d = 0; d < 3; d++) // dimensions
+  for (int normal = 0; normal < 2; normal++)
+  {
+    int i = 0, j = 0, k = 0, l = 0, w = 0, h = 0;
+    int u = (d + 1) % 3;
+    int v = (d + 2) % 3;
+
+    int p[3] = { 0, 0, 0 };
+    int n[3] = { 0, 0, 0 };
+
+    bool mask[CHUNK][CHUNK];
+    n[d] = 1;
+
+    for (p[d] = -1; p[d] < CHUNK;) {
+      for (p[v] = 0; p[v] < CHUNK; p[v]++)
+      for (p[u] = 0; p[u] < CHUNK; p[u]++) {
+        bool block = color == col(cx+p[0],      cy+p[1],      cz+p[2]     );
+        bool ahead = color == col(cx+p[0]+n[0], cy+p[1]+n[1], cz+p[2]+n[2]);
+
+        mask[p[v]][p[u]] =
+            (normal==0 && block && !ahead) ||
+            (normal==1 && !block && ahead)
+        ;
+      }
+
+      p[d]++;
+
+      for (j = 0; j < CHUNK; j++)
+      for (i = 0; i < CHUNK; i++)
+      {
+        if (!mask[j][i]) continue;
+
+        for (w = 1; i+w < CHUNK && mask[j][i+w]; w++) continue;
+
+        for (h = 1; j + h < CHUNK; h++)
+        for (k = 0; k < w; k++)
+        {
+          if (!mask[j+h][i+k]) goto break2;
+        }
+        break2:
+
+        p[u] = i;
+        p[v] = j;
+
+        int du[3] = {0, 0, 0};
+        int dv[3] = {0, 0, 0};
+
+        du[u] = w;
+        dv[v] = h;
+
+        // glass material has id=2
+        int id = color == pal_size-1 ? 2 : 0;
+        quad(
+            cx+p[0], cy+p[1], cz+p[2],
+            du[0], du[1], du[2],
+            dv[0], dv[1], dv[2],
+            color, d*2 + normal, id
+           );
+
+        for (l = 0; l < h; l++)
+        for (k = 0; k < w; k++)
+        {
+          mask[j+l][i+k] = false;
+        }
+
+        i--;
+        i += w;
+      }
+    }
+  }
+}
+
+// every chunk of every color, in file order
+inline void faces(const auto &col, int pal_size, auto quad) {
+  for (int color = 0; color < pal_size; color++)
+  for (int cx = 0; cx < col.nx; cx += CHUNK)
+  for (int cy = 0; cy < col.ny; cy += CHUNK)
+  for (int cz = 0; cz < col.nz; cz += CHUNK)
+    chunk(col, pal_size, color, cx, cy, cz, quad);
+}
+
+} // namespace stages
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// Per-stage scheduling for the parallel loops.
+//
+// Each stage runs with a config: how many threads, which TBB partitioner,
+// and the grain (the fewest iterations one task gets, or for tiled loops
+// the fewest tiles along x and along y). The parallel loops in voxmap.h
+// read the config of the stage they run in, so the stages themselves
+// don't change. bin/voxmap --tune times every combination per stage and
+// saves the fastest to a profile, which later runs load if it exists:
+//
+//   # stage threads partitioner grain
+//   summed 8 auto 4
+//
+// threads 0 means all of them.
+
+namespace tune {
+
+enum partitioner { AUTO, SIMPLE, STATIC, PARTITIONERS };
+const char *const NAMES[PARTITIONERS] = {"auto", "simple", "static"};
+
+struct config {
+  int threads = 0;
+  int partitioner = AUTO;
+  int grain = 1;
+};
+
+// the config loops on this thread follow; set by run()
+inline thread_local config current;
+
+inline int grain() { return current.grain; }
+
+// tbb::parallel_for with the current config's partitioner
+template <typename Range, typename Body>
+void parallel_for(const Range &range, const Body &body) {
+  switch (current.partitioner) {
+  case SIMPLE: tbb::parallel_for(range, body, tbb::simple_partitioner()); break;
+  case STATIC: tbb::parallel_for(range, body, tbb::static_partitioner()); break;
+  default: tbb::parallel_for(range, body, tbb::auto_partitioner()); break;
+  }
+}
+
+// run function with config c, in an arena of c.threads threads
+inline void run(const config &c, auto function) {
+  tbb::task_arena arena(c.threads > 0 ? c.threads : tbb::task_arena::automatic);
+  arena.execute([&] {
+    config outer = current;
+    current = c;
+    function();
+    current = outer;
+  });
+}
+
+// stage name -> config; stages without an entry use the defaults
+class profile {
+  std::map<std::string, config> stages;
+
+public:
+  config operator[](std::string stage) const {
+    auto it = stages.find(stage);
+    return it == stages.end() ? config() : it->second;
+  }
+  void set(std::string stage, config c) { stages[stage] = c; }
+
+  // false if there is no profile at path
+  bool load(std::string path) {
+    std::ifstream in(path);
+    if (!in) return false;
+    for (std::string line; std::getline(in, line);) {
+      if (line.empty() || line[0] == '#') continue;
+      std::istringstream fields(line);
+      std::string stage, name;
+      config c;
+      if (!(fields >> stage >> c.threads >> name >> c.grain))
+        throw std::runtime_error("tune: bad line in " + path + ": " + line);
+      c.partitioner = PARTITIONERS;
+      for (int p = 0; p < PARTITIONERS; p++)
+        if (name == NAMES[p]) c.partitioner = p;
+      if (c.partitioner == PARTITIONERS)
+        throw std::runtime_error("tune: unknown partitioner " + name);
+      stages[stage] = c;
+    }
+    return true;
+  }
+
+  void save(std::string path) const {
+    std::ofstream out(path);
+    out.exceptions(std::fstream::badbit | std::fstream::failbit);
+    out << "# stage threads partitioner grain\n";
+    for (auto &[stage, c] : stages)
+      out << stage << " " << c.threads << " " << NAMES[c.partitioner] << " "
+          << c.grain << "\n";
+  }
+};
+
+} // namespace tune
@@ -0,0 +1,27 @@
+#include "codec.h"
+#include "filter.h"
+#include <fstream>
+#include <iostream>
+
+// Reference decoder for out/map.planes.*: turns it back into map.bin,
+// so a filtered build can be checked with
+//   bin/unfilter out/map.planes.gz out/map.unfiltered.bin
+//   cmp out/map.bin out/map.unfiltered.bin
+
+int main(int argc, char **argv)
+{
+	if(argc != 3) {
+		std::cerr << "usage: " << argv[0] << " map.planes[.gz|.br|.zst] map.bin" << std::endl;
+		return 1;
+	}
+
+	int X, Y, Z;
+	std::vector<char> map = filter::decode(codec::read(argv[1]), X, Y, Z);
+
+	std::ofstream out(argv[2], std::ios::binary);
+	out.exceptions(std::fstream::badbit);
+	out.write(map.data(), map.size());
+
+	std::cout << X << " x " << Y << " x " << Z << std::endl;
+	return 0;
+}
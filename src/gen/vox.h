@@ -0,0 +1,378 @@
+#pragma once
+
+#include "voxmap.h"
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// MagicaVoxel .vox reader and writer.
+// https://github.com/ephtracy/voxel-model/blob/master/MagicaVoxel-file-format-vox.txt
+//
+// Models are placed in the world through the nTRN/nGRP/nSHP scene graph;
+// a voxel lands at translation + (v - size / 2), z up. Rotations are not
+// supported. Files without a scene graph put every model at the origin.
+
+namespace vox {
+
+// 0xRRGGBB for palette index i, MagicaVoxel's built-in palette:
+// a 6x6x6 color cube, then red, green, blue and gray ramps
+inline std::array<int, 256> default_palette() {
+  const int cube[6] = {0xff, 0xcc, 0x99, 0x66, 0x33, 0x00};
+  const int ramp[10] = {0xee, 0xdd, 0xbb, 0xaa, 0x88,
+                        0x77, 0x55, 0x44, 0x22, 0x11};
+  std::array<int, 256> pal = {};
+  int i = 1;
+  for (int r : cube)
+  for (int g : cube)
+  for (int b : cube)
+    if (i < 216) pal[i++] = r << 16 | g << 8 | b;
+  for (int shift : {16, 8, 0})
+    for (int v : ramp) pal[i++] = v << shift;
+  for (int v : ramp) pal[i++] = v << 16 | v << 8 | v;
+  return pal;
+}
+
+struct scene {
+  struct model {
+    int size[3] = {0, 0, 0};
+    const uint8_t *xyzi = nullptr; // 4 bytes per voxel: x y z color index
+    int count = 0;
+  };
+  struct placement {
+    int model;
+    int offset[3];
+  };
+
+  std::vector<char> bytes;
+  std::vector<model> models;
+  std::vector<placement> placements;
+  std::array<int, 256> palette = default_palette();
+
+  explicit scene(std::string path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("vox: cannot open " + path);
+    bytes.assign(std::istreambuf_iterator<char>(file), {});
+    parse();
+  }
+
+  // call f(x, y, z, 0xRRGGBB) for every voxel of every placed model
+  void each(auto f) const {
+    for (auto &p : placements) {
+      const model &m = models[p.model];
+      for (int i = 0; i < m.count; i++) {
+        const uint8_t *v = m.xyzi + 4 * i;
+        f(p.offset[0] + v[0], p.offset[1] + v[1], p.offset[2] + v[2],
+          palette[v[3]]);
+      }
+    }
+  }
+
+  // smallest corner of the occupied voxels
+  std::array<int, 3> min() const {
+    std::array<int, 3> lo = {INT_MAX, INT_MAX, INT_MAX};
+    each([&](int x, int y, int z, int) {
+      lo = {std::min(lo[0], x), std::min(lo[1], y), std::min(lo[2], z)};
+    });
+    return lo;
+  }
+
+private:
+  struct node {
+    char type; // 'T'ransform, 'G'roup or 'S'hape
+    int offset[3] = {0, 0, 0};
+    std::vector<int> children; // node ids, or model ids for shapes
+
+    explicit node(char type = 0) : type(type) {}
+  };
+
+  size_t pos = 0;
+
+  void need(size_t n) {
+    if (pos + n > bytes.size()) throw std::runtime_error("vox: truncated file");
+  }
+  int32_t i32() {
+    need(4);
+    int32_t x;
+    memcpy(&x, &bytes[pos], 4);
+    pos += 4;
+    return x;
+  }
+  std::string str() {
+    int n = i32();
+    need(n);
+    std::string s(&bytes[pos], n);
+    pos += n;
+    return s;
+  }
+  std::map<std::string, std::string> dict() {
+    std::map<std::string, std::string> d;
+    for (int n = i32(); n > 0; n--) {
+      std::string key = str();
+      d[key] = str();
+    }
+    return d;
+  }
+
+  void parse() {
+    need(8);
+    if (memcmp(bytes.data(), "VOX ", 4)) throw std::runtime_error("vox: bad magic");
+    pos = 8;
+
+    std::map<int, node> nodes;
+    int size[3] = {0, 0, 0};
+
+    while (pos + 12 <= bytes.size()) {
+      std::string id(&bytes[pos], 4);
+      pos += 4;
+      int content = i32();
+      int children = i32();
+      size_t end = pos + content;
+      need(content);
+
+      if (id == "MAIN") {
+        pos = end; // its children follow as ordinary chunks
+        continue;
+      } else if (id == "SIZE") {
+        for (int &s : size) s = i32();
+      } else if (id == "XYZI") {
+        model m;
+        memcpy(m.size, size, sizeof size);
+        m.count = i32();
+        need(4 * (size_t)m.count);
+        m.xyzi = (const uint8_t *)&bytes[pos];
+        models.push_back(m);
+      } else if (id == "RGBA") {
+        // chunk color i is palette index i + 1, of 256
+        if (content < 4 * 256) throw std::runtime_error("vox: short RGBA chunk");
+        for (int i = 0; i < 255; i++) {
+          const uint8_t *c = (const uint8_t *)&bytes[pos + 4 * i];
+          palette[i + 1] = c[0] << 16 | c[1] << 8 | c[2];
+        }
+      } else if (id == "nTRN") {
+        node n('T');
+        int self = i32();
+        dict();
+        n.children.push_back(i32());
+        i32(); // reserved
+        i32(); // layer
+        for (int frames = i32(); frames > 0; frames--) {
+          auto d = dict();
+          if (d.count("_r") && d["_r"] != "4") // 4 is the identity
+            throw std::runtime_error("vox: rotated models are not supported");
+          if (d.count("_t")) {
+            std::istringstream t(d["_t"]);
+            t >> n.offset[0] >> n.offset[1] >> n.offset[2];
+          }
+        }
+        nodes[self] = n;
+      } else if (id == "nGRP") {
+        node n('G');
+        int self = i32();
+        dict();
+        for (int k = i32(); k > 0; k--) n.children.push_back(i32());
+        nodes[self] = n;
+      } else if (id == "nSHP") {
+        node n('S');
+        int self = i32();
+        dict();
+        for (int k = i32(); k > 0; k--) {
+          n.children.push_back(i32());
+          dict();
+        }
+        nodes[self] = n;
+      }
+
+      pos = end + children;
+    }
+
+    if (nodes.empty()) {
+      for (int m = 0; m < (int)models.size(); m++) placements.push_back({m, {0, 0, 0}});
+      return;
+    }
+
+    // walk the scene graph from the root, summing translations
+    auto walk = [&](auto &walk, int id, int x, int y, int z) -> void {
+      if (!nodes.count(id)) throw std::runtime_error("vox: dangling scene node");
+      node &n = nodes[id];
+      x += n.offset[0];
+      y += n.offset[1];
+      z += n.offset[2];
+      for (int child : n.children) {
+        if (n.type != 'S') {
+          walk(walk, child, x, y, z);
+          continue;
+        }
+        if (child < 0 || child >= (int)models.size())
+          throw std::runtime_error("vox: dangling model");
+        const int *s = models[child].size;
+        placements.push_back({child, {x - s[0] / 2, y - s[1] / 2, z - s[2] / 2}});
+      }
+    };
+    walk(walk, 0, 0, 0, 0);
+  }
+};
+
+const int MAX_MODEL = 256; // voxels per model side MagicaVoxel accepts
+
+namespace detail {
+
+inline void put(std::vector<char> &out, int32_t v) {
+  out.insert(out.end(), (const char *)&v, (const char *)&v + 4);
+}
+inline void put(std::vector<char> &out, std::string s) {
+  put(out, (int32_t)s.size());
+  out.insert(out.end(), s.begin(), s.end());
+}
+inline void chunk(std::vector<char> &out, const char *id, int32_t content) {
+  out.insert(out.end(), id, id + 4);
+  put(out, content);
+  put(out, 0); // children
+}
+
+} // namespace detail
+
+// Write an nx*ny*nz volume, color(x, y, z) being the palette index of
+// each voxel (0 for none), so that scene reads it back at the same
+// coordinates. The volume is cut into models of at most MAX_MODEL^3,
+// each placed by its own transform. Voxels are counted, then serialized
+// into their place in one pre-sized buffer, an x slice of a model per
+// task (color is called from many threads), and the file is one write.
+inline void write(std::string path, int nx, int ny, int nz, auto color,
+                  const std::array<int, 256> &palette = default_palette()) {
+  using detail::put;
+  struct model {
+    int origin[3], size[3];
+  };
+  std::vector<model> models;
+  for (int x = 0; x < nx; x += MAX_MODEL)
+  for (int y = 0; y < ny; y += MAX_MODEL)
+  for (int z = 0; z < nz; z += MAX_MODEL)
+    models.push_back({{x, y, z},
+                      {std::min(MAX_MODEL, nx - x), std::min(MAX_MODEL, ny - y),
+                       std::min(MAX_MODEL, nz - z)}});
+
+  struct slice {
+    int model, x; // x within the model
+    size_t count = 0, at = 0; // voxels, and where the first one goes
+  };
+  std::vector<slice> slices;
+  for (int m = 0; m < (int)models.size(); m++)
+    for (int x = 0; x < models[m].size[0]; x++) slices.push_back({m, x});
+
+  auto each = [&](const slice &s, auto f) {
+    const model &m = models[s.model];
+    for (int y = 0; y < m.size[1]; y++)
+    for (int z = 0; z < m.size[2]; z++)
+      if (uint8_t c = color(m.origin[0] + s.x, m.origin[1] + y, m.origin[2] + z))
+        f(y, z, c);
+  };
+  parFor(0, slices.size(), [&](int i) {
+    each(slices[i], [&](int, int, uint8_t) { slices[i].count++; });
+  });
+
+  // each model's SIZE and XYZI chunks, then the scene graph and palette
+  const size_t SIZE = 12 + 12, XYZI = 12 + 4;
+  std::vector<size_t> counts(models.size()), starts(models.size());
+  size_t at = 8 + 12;
+  for (size_t i = 0; i < slices.size(); i++) {
+    slice &s = slices[i];
+    if (s.x == 0) {
+      starts[s.model] = at;
+      at += SIZE + XYZI;
+    }
+    s.at = at;
+    at += 4 * s.count;
+    counts[s.model] += s.count;
+  }
+
+  std::vector<char> scene;
+  auto node = [&](const char *id, auto body) {
+    std::vector<char> content;
+    body(content);
+    detail::chunk(scene, id, content.size());
+    scene.insert(scene.end(), content.begin(), content.end());
+  };
+  auto transform = [&](int self, int child, int layer, std::string t) {
+    node("nTRN", [&](std::vector<char> &c) {
+      put(c, self);
+      put(c, 0); // attributes
+      put(c, child);
+      put(c, -1); // reserved
+      put(c, layer);
+      put(c, 1); // frames
+      put(c, t.empty() ? 0 : 1);
+      if (!t.empty()) put(c, "_t"), put(c, t);
+    });
+  };
+  transform(0, 1, -1, "");
+  node("nGRP", [&](std::vector<char> &c) {
+    put(c, 1);
+    put(c, 0);
+    put(c, (int32_t)models.size());
+    for (int m = 0; m < (int)models.size(); m++) put(c, 2 + 2 * m);
+  });
+  for (int m = 0; m < (int)models.size(); m++) {
+    const model &mo = models[m];
+    transform(2 + 2 * m, 3 + 2 * m, 0,
+              std::to_string(mo.origin[0] + mo.size[0] / 2) + " " +
+                  std::to_string(mo.origin[1] + mo.size[1] / 2) + " " +
+                  std::to_string(mo.origin[2] + mo.size[2] / 2));
+    node("nSHP", [&](std::vector<char> &c) {
+      put(c, 3 + 2 * m);
+      put(c, 0);
+      put(c, 1); // models
+      put(c, m);
+      put(c, 0);
+    });
+  }
+  // chunk color i is palette index i + 1
+  detail::chunk(scene, "RGBA", 4 * 256);
+  for (int i = 0; i < 256; i++) {
+    int rgb = palette[(i + 1) % 256];
+    for (int shift : {16, 8, 0}) scene.push_back((char)(rgb >> shift));
+    scene.push_back((char)0xff);
+  }
+
+  std::vector<char> out(at + scene.size());
+  auto header = [&](size_t where, std::vector<char> bytes) {
+    std::copy(bytes.begin(), bytes.end(), out.begin() + where);
+  };
+  std::vector<char> top = {'V', 'O', 'X', ' '};
+  put(top, 150);
+  top.insert(top.end(), {'M', 'A', 'I', 'N'});
+  put(top, 0);
+  put(top, (int32_t)(out.size() - 20)); // every other chunk is its child
+  header(0, top);
+  for (int m = 0; m < (int)models.size(); m++) {
+    std::vector<char> h;
+    detail::chunk(h, "SIZE", 12);
+    for (int d = 0; d < 3; d++) put(h, models[m].size[d]);
+    detail::chunk(h, "XYZI", 4 + 4 * counts[m]);
+    put(h, (int32_t)counts[m]);
+    header(starts[m], h);
+  }
+  parFor(0, slices.size(), [&](int i) {
+    char *p = &out[slices[i].at];
+    uint8_t x = slices[i].x;
+    each(slices[i], [&](int y, int z, uint8_t c) {
+      *p++ = x, *p++ = y, *p++ = z, *p++ = c;
+    });
+  });
+  std::copy(scene.begin(), scene.end(), out.begin() + at);
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file) throw std::runtime_error("vox: cannot write " + path);
+  file.exceptions(std::fstream::badbit | std::fstream::failbit);
+  file.write(out.data(), out.size());
+}
+
+} // namespace vox
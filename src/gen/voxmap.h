@@ -1,7 +1,17 @@
+#pragma once
+
+#include "memory.h"
+#include "tune.h"
 #include <tbb/blocked_range3d.h>
 #include <tbb/parallel_for.h>
 #include <tbb/tbb.h>
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 const int X = 1024;
 const int Y = 256;
@@ -16,52 +26,228 @@ const int N_pixels = X*Y;
 const int N_voxels = X*Y*Z;
 const int N_chunks = X*Y*Z/CHUNK/CHUNK/CHUNK;
 
-void parXY(auto function) {
-  auto sec_order = [&](int i){
-    auto x = i % X;
-    auto y = i / X;
-    function(x, y);
-  };
-  tbb::parallel_for(0, N_pixels, sec_order);
+// command-line flags, either "--flag" or "--flag value"
+struct Args {
+  std::vector<std::string> argv;
+
+  Args(int argc, char **argv) : argv(argv + 1, argv + argc) {}
+
+  bool has(std::string flag) const {
+    for (auto &arg : argv) if (arg == flag) return true;
+    return false;
+  }
+  std::string get(std::string flag, std::string fallback) const {
+    for (size_t i = 0; i + 1 < argv.size(); i++)
+      if (argv[i] == flag) return argv[i + 1];
+    return fallback;
+  }
+  int get(std::string flag, int fallback) const {
+    return std::stoi(get(flag, std::to_string(fallback)));
+  }
+};
+
+// Strided window into a Grid: (0, 0, 0) is wherever the view was taken,
+// and any stride may be negative or permuted
+template <typename T>
+struct View {
+  T *origin;
+  ptrdiff_t sx, sy, sz;
+
+  T &operator()(int x, int y, int z) const {
+    return origin[x * sx + y * sy + z * sz];
+  }
+};
+
+// Parallel loops over an nx*ny*nz box cut into TX*TY*TZ tiles, z fastest.
+// Each task gets whole tiles, so the scheduling cost is paid per tile and
+// not per cell, and inside a full tile the loop bounds are compile-time
+// constants the compiler can unroll and vectorize. Tiles at the far edges
+// are clipped to the box. Scheduling follows the stage's tune::config.
+//
+// parTiles calls tile(x0, y0, z0, x1, y1, z1) with the tile's half-open
+// bounds, for callers that want to write the loops themselves.
+template <int TX, int TY, int TZ>
+void parTiles(int nx, int ny, int nz, auto tile) {
+  tune::parallel_for(
+      tbb::blocked_range3d<int>(0, (nx + TX - 1) / TX, tune::grain(),
+                                0, (ny + TY - 1) / TY, tune::grain(),
+                                0, (nz + TZ - 1) / TZ, 1),
+      [&](const tbb::blocked_range3d<int> &r) {
+        for (int tx = r.pages().begin(); tx < r.pages().end(); tx++)
+        for (int ty = r.rows().begin(); ty < r.rows().end(); ty++)
+        for (int tz = r.cols().begin(); tz < r.cols().end(); tz++)
+          tile(tx * TX, ty * TY, tz * TZ,
+               std::min(nx, (tx + 1) * TX),
+               std::min(ny, (ty + 1) * TY),
+               std::min(nz, (tz + 1) * TZ));
+      });
 }
-void parXYZ(auto function) {
-  auto sec_order = [&](int i){
-    auto x = i % X;
-    auto y = i / X % Y;
-    auto z = i / X / Y;
-    function(x, y, z);
-  };
-  tbb::parallel_for(0, N_voxels, sec_order);
+
+// function(x, y, z) for every cell, tile by tile
+template <int TX, int TY, int TZ>
+void parTiledXYZ(int nx, int ny, int nz, auto function) {
+  parTiles<TX, TY, TZ>(nx, ny, nz,
+      [&](int x0, int y0, int z0, int x1, int y1, int z1) {
+        if (x1 - x0 == TX && y1 - y0 == TY && z1 - z0 == TZ) {
+          for (int x = 0; x < TX; x++)
+          for (int y = 0; y < TY; y++)
+          for (int z = 0; z < TZ; z++)
+            function(x0 + x, y0 + y, z0 + z);
+          return;
+        }
+        for (int x = x0; x < x1; x++)
+        for (int y = y0; y < y1; y++)
+        for (int z = z0; z < z1; z++)
+          function(x, y, z);
+      });
+}
+
+// function(x, y) for every cell of an nx*ny plane, tile by tile
+template <int TX, int TY>
+void parTiledXY(int nx, int ny, auto function) {
+  parTiledXYZ<TX, TY, 1>(nx, ny, 1,
+      [&](int x, int y, int) { function(x, y); });
 }
-void parChunkXYZ(auto function) {
-  auto sec_order = [&](int i){
-    auto x = i * CHUNK % X;
-    auto y = i * CHUNK / X % Y;
-    auto z = i * CHUNK / X / Y;
-    function(x, y, z);
-  };
-  tbb::parallel_for(0, N_chunks , sec_order);
+
+// function(i) for i in [begin, end), likewise
+void parFor(int begin, int end, auto function) {
+  tune::parallel_for(tbb::blocked_range<int>(begin, end, tune::grain()),
+      [&](const tbb::blocked_range<int> &r) {
+        for (int i = r.begin(); i < r.end(); i++) function(i);
+      });
 }
+
+// Storage layouts for Grid: where cell (x, y, z) of an nx*ny*nz box lives,
+// all coordinates counted from the box's corner (so never negative).
+//
+// Linear is [x][y][z] with z fastest: z neighbors are adjacent, but x
+// neighbors are a whole y*z slice apart. Brick<B> tiles the box into B^3
+// bricks, each stored linearly, bricks themselves in [x][y][z] order: all
+// 26 neighbors of a cell are at most a few bricks away, so 3D stencils
+// touch a handful of pages instead of one per x step. Boxes are rounded up
+// to whole bricks.
+struct Linear {
+  static constexpr uint32_t id = 0; // recorded in snapshots
+  ptrdiff_t sx, sy; // strides of x and y; z's is 1
+  size_t n;
+
+  Linear(int nx, int ny, int nz)
+      : sx((ptrdiff_t)ny * nz), sy(nz), n((size_t)nx * ny * nz) {}
+
+  size_t size() const { return n; }
+  size_t operator()(int x, int y, int z) const { return x * sx + y * sy + z; }
+};
+
+// [z][y][x] with x fastest: the order 3D textures are uploaded in, so a
+// grid of texels in this layout is the texture file byte for byte
+struct ZYX {
+  static constexpr uint32_t id = 1;
+  size_t sy, sz; // strides of y and z; x's is 1
+  size_t n;
+
+  ZYX(int nx, int ny, int nz)
+      : sy(nx), sz((size_t)nx * ny), n((size_t)nx * ny * nz) {}
+
+  size_t size() const { return n; }
+  size_t operator()(int x, int y, int z) const { return z * sz + y * sy + x; }
+};
+
+template <int B>
+struct Brick {
+  static_assert(B > 1 && (B & (B - 1)) == 0, "bricks are powers of two");
+  static constexpr uint32_t id = B;
+  static constexpr unsigned CELLS = B * B * B;
+  size_t bx, by, bz; // bricks along each axis
+
+  Brick(int nx, int ny, int nz)
+      : bx((nx + B - 1) / B), by((ny + B - 1) / B), bz((nz + B - 1) / B) {}
+
+  size_t size() const { return bx * by * bz * CELLS; }
+  size_t operator()(unsigned x, unsigned y, unsigned z) const {
+    size_t brick = (x / B * by + y / B) * bz + z / B;
+    return brick * CELLS + (x % B * B + y % B) * B + z % B;
+  }
+};
+
+// Dense nx*ny*nz volume of T, stored in layout L (Linear unless asked),
+// surrounded by a ghost border P cells thick so stencils can step outside
+// the map without clamping. A new grid, border included, is all zeros,
+// on huge pages first touched in parallel (see memory.h).
+template <typename T, int P = 1, typename L = Linear>
+class Grid {
+  static_assert(std::is_trivially_copyable_v<T>, "grids hold plain data");
+  memory::block owned;
+  T *base;
+
+public:
+  using value_type = T;
+  using layout_type = L;
+  const int nx, ny, nz;
+  const L layout;
+
+  Grid(int nx, int ny, int nz = 1)
+      : nx(nx), ny(ny), nz(nz), layout(nx + 2 * P, ny + 2 * P, nz + 2 * P) {
+    owned = memory::block(bytes());
+    base = (T *)owned.get();
+  }
+
+  // over external storage of size() elements, e.g. a mapped snapshot
+  Grid(int nx, int ny, int nz, void *storage)
+      : nx(nx), ny(ny), nz(nz), layout(nx + 2 * P, ny + 2 * P, nz + 2 * P) {
+    base = (T *)storage;
+  }
+
+  // elements and bytes of storage, ghost border included
+  size_t size() const { return layout.size(); }
+  size_t bytes() const { return size() * sizeof(T); }
+  T *data() const { return base; }
+
+  // switch to external storage of size() elements, e.g. a mapped snapshot
+  void bind(void *storage) {
+    owned = memory::block();
+    base = (T *)storage;
+  }
+
+  size_t index(int x, int y, int z) const {
+    return layout(x + P, y + P, z + P);
+  }
+  T &operator()(int x, int y, int z = 0) const { return base[index(x, y, z)]; }
+
+  // only linear storage has fixed strides
+  View<T> view(int x, int y, int z) const
+    requires std::is_same_v<L, Linear>
+  {
+    return {&(*this)(x, y, z), layout.sx, layout.sy, 1};
+  }
+
+  // copy the interior of another grid of the same size, any layout
+  template <typename G>
+  void assign(const G &other) const {
+    for_each([&](int x, int y, int z) { (*this)(x, y, z) = other(x, y, z); });
+  }
+
+  // fill the ghost border with copies of the nearest edge cell, so reads
+  // outside the map match the old std::clamp accessors
+  void clamp_border() const {
+    tbb::parallel_for(-P, nx + P, [&](int x) {
+      int cx = std::clamp(x, 0, nx - 1);
+      for (int y = -P; y < ny + P; y++)
+      for (int z = -P; z < nz + P; z++) {
+        int cy = std::clamp(y, 0, ny - 1);
+        int cz = std::clamp(z, 0, nz - 1);
+        if (cx != x || cy != y || cz != z) (*this)(x, y, z) = (*this)(cx, cy, cz);
+      }
+    });
+  }
+
+  // call function(x, y, z) for every interior cell, in parallel 3D tiles
+  void for_each(auto function) const {
+    parTiledXYZ<16, 16, 32>(nx, ny, nz, function);
+  }
+};
+
 void forXY(auto function) {
   for (int x = 0; x < X; x++)
   for (int y = 0; y < Y; y++)
     function(x, y);
 }
-void forXYZ(auto function) {
-  for (int x = 0; x < X; x++)
-  for (int y = 0; y < Y; y++)
-  for (int z = 0; z < Z; z++)
-    function(x, y, z);
-}
-void forZYX(auto function) {
-  for (int z = 0; z < Z; z++)
-  for (int y = 0; y < Y; y++)
-  for (int x = 0; x < X; x++)
-    function(x, y, z);
-}
-void forChunkXYZ(auto function) {
-  for (int x = 0; x < X; x += CHUNK)
-  for (int y = 0; y < Y; y += CHUNK)
-  for (int z = 0; z < Z; z += CHUNK)
-    function(x, y, z);
-}
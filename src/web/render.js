@@ -57,6 +57,28 @@ const D = {
     .then(array => pako.ungzip(array))
 }
 
+// Undo src/gen/filter.h: the map ships as delta-coded SDF planes plus a
+// color plane, and the GPU wants interleaved RGBA texels. A map without
+// the "VXP1" magic, like a blob encrypted before --filter, is already
+// interleaved and passes through.
+const unplane = (planes) => {
+    if (String.fromCharCode(...planes.subarray(0, 4)) != "VXP1") return planes
+    const word = i => planes[i] | planes[i + 1] << 8 | planes[i + 2] << 16 | planes[i + 3] << 24
+    const [_X, _Y, _Z, axis] = [4, 8, 12, 16].map(word)
+    const n = _X * _Y * _Z
+    const stride = [1, _X, _X * _Y][axis]
+    const period = stride * [_X, _Y, _Z][axis]
+    const plane = planes.subarray(20)
+    const map = new Uint8Array(C * n)
+    for (let i = 0; i < n; i++) {
+        const first = i % period < stride
+        for (let c = 0; c < 2; c++)
+            map[C * i + c] = (first ? 0 : map[C * (i - stride) + c]) + plane[c * n + i]
+        map[C * i + 2] = plane[2 * n + i]
+    }
+    return map
+}
+
 //-- 4-vector operations
 const clamp_xyzc = (xyzc) => [X, Y, Z, C].map((max, i) => clamps(xyzc[i], 0, max - 1)) // clamp
 const project_xyzc = ([_x, _y, _z, _c]) => C * (X * (Y * (_z) + _y) + _x) + _c // project
@@ -131,15 +153,67 @@ async function initPrograms() {
     U.map = gl.getUniformLocation(P.renderer, "u_map")
 }
 
+// Halve an RGB tile of t*t texels, each the rounded mean of 2x2
+const halve = (tile, t) => {
+    const h = t / 2
+    const half = new Uint8Array(3 * h * h)
+    for (let x = 0; x < h; x++)
+        for (let y = 0; y < h; y++)
+            for (let c = 0; c < 3; c++) {
+                const texel = (dx, dy) => tile[3 * ((2 * x + dx) * t + 2 * y + dy) + c]
+                half[3 * (x * h + y) + c] = (texel(0, 0) + texel(0, 1) + texel(1, 0) + texel(1, 1) + 2) >> 2
+            }
+    return half
+}
+
+// The noise texture, either whole (res/noise.bin.gz) or as bin/noise
+// --split writes it (see src/gen/noise.cpp): the fractal plane with its
+// mip levels, plus a small tile of the random channels. Each mip level is
+// put back together from the two, so the shader sees the same texture.
+async function loadNoise() {
+    const manifest = await fetch("res/noise.json")
+        .then(response => response.ok ? response.json() : null)
+        .catch(() => null)
+
+    T.noise = gl.createTexture()
+    gl.bindTexture(gl.TEXTURE_2D, T.noise)
+
+    if (!manifest) {
+        D.noise = await D.fetch("res/noise.bin.gz")
+        gl.texImage2D(gl.TEXTURE_2D, 0, gl.RGBA, X, X, 0, gl.RGBA, gl.UNSIGNED_BYTE, D.noise)
+        gl.generateMipmap(gl.TEXTURE_2D)
+        return
+    }
+
+    const [fbm, white] = await Promise.all(
+        [manifest.fbm, manifest.white].map(part => D.fetch("res/" + part.file))
+    )
+    let tile = white, t = manifest.white.size
+    for (let level = 0, n = manifest.size, at = 0; level < manifest.fbm.levels; level++) {
+        const texels = new Uint8Array(4 * n * n)
+        for (let x = 0; x < n; x++)
+            for (let y = 0; y < n; y++) {
+                const i = x * n + y, j = 3 * (x % t * t + y % t)
+                for (let c = 0; c < 3; c++) texels[4 * i + c] = tile[j + c]
+                texels[4 * i + 3] = fbm[at + i]
+            }
+        gl.texImage2D(gl.TEXTURE_2D, level, gl.RGBA, n, n, 0, gl.RGBA, gl.UNSIGNED_BYTE, texels)
+
+        // the tile shrinks with the texture, down to its mean
+        if (t > 1) {
+            tile = halve(tile, t)
+            t /= 2
+        }
+        at += n * n
+        n /= 2
+    }
+}
+
 async function loadTextures() {
     gl.useProgram(P.renderer)
 
     // Load in noise
-    D.noise = await D.fetch("res/noise.bin.gz")
-    T.noise = gl.createTexture()
-    gl.bindTexture(gl.TEXTURE_2D, T.noise)
-    gl.texImage2D(gl.TEXTURE_2D, 0, gl.RGBA, X, X, 0, gl.RGBA, gl.UNSIGNED_BYTE, D.noise)
-    gl.generateMipmap(gl.TEXTURE_2D)
+    await loadNoise()
     gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MIN_FILTER, gl.LINEAR_MIPMAP_LINEAR);
     gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MAG_FILTER, gl.LINEAR);
     gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_WRAP_S, gl.REPEAT);
@@ -191,7 +265,7 @@ async function loadEncryptedTextures() {
     gl.useProgram(P.renderer)
 
     // Load in the SDF 3D texture
-    D.map = await D.fetch(encrypted ? "res/map.blob" : "out/map.bin.gz" )
+    D.map = unplane(await D.fetch(encrypted ? "res/map.blob" : "out/map.planes.gz" ))
     T.map = gl.createTexture()
     gl.bindTexture(gl.TEXTURE_3D, T.map)
     gl.texImage3D(gl.TEXTURE_3D, 0, gl.RGBA, X, Y, Z, 0, gl.RGBA, gl.UNSIGNED_BYTE, D.map)